@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#ifndef _OUICHEFS_BITMAP_H
+#define _OUICHEFS_BITMAP_H
+
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include "ouichefs.h"
+
+/*
+ * Remember that the on-disk bitmap block holding bit i of bm has to be written
+ * by the next sync_fs. Dirty bits are indexed by bitmap block, inode bitmap
+ * blocks first. Atomic, bits handed out by CPU caches are marked without
+ * bitmap_lock.
+ */
+static inline void mark_bitmap_dirty(struct ouichefs_sb_info *sbi,
+				     struct ouichefs_bitmap *bm, uint32_t i)
+{
+	set_bit(bm->dirty + i / (sbi->s_block_size * BITS_PER_BYTE),
+		sbi->bitmap_dirty);
+}
+
+/*
+ * Return an unused inode number and mark it used.
+ * Return 0 if no free inode was found.
+ */
+static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_bitmap_get(sbi, &sbi->ifree, &sbi->nr_free_inodes);
+}
+
+/*
+ * Return an unused inode number close to ino and mark it used: one of the
+ * inode store block of ino held by the cache of the current CPU, else the
+ * first one from the start of that block on, in the same bitmap block.
+ * Return 0 if there is none there, or if the shared bitmap is contended.
+ */
+static inline uint32_t get_free_inode_near(struct ouichefs_sb_info *sbi,
+					   uint32_t ino)
+{
+	uint32_t start = ino - ino % sbi->inodes_per_block;
+
+	ino = ouichefs_bitmap_get_near(sbi, &sbi->ifree, start,
+				       start + sbi->inodes_per_block);
+	if (ino)
+		return ino;
+	return ouichefs_bitmap_alloc_range(sbi, &sbi->ifree,
+					   &sbi->nr_free_inodes, start,
+					   sbi->nr_inodes, 1);
+}
+
+/*
+ * Return the first inode number of an unused inode store block of bitmap
+ * block idx and mark it used. Return 0 if all blocks are at least partly used,
+ * or if the shared bitmap is contended.
+ */
+static inline uint32_t get_free_inode_block(struct ouichefs_sb_info *sbi,
+					    uint32_t idx)
+{
+	uint32_t bits = sbi->s_block_size * BITS_PER_BYTE;
+
+	return ouichefs_bitmap_alloc_range(sbi, &sbi->ifree,
+					   &sbi->nr_free_inodes, idx * bits,
+					   (idx + 1) * bits,
+					   sbi->inodes_per_block);
+}
+
+/*
+ * Return an unused block number and mark it used.
+ * Return 0 if no free block was found.
+ */
+static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_bitmap_get(sbi, &sbi->bfree, &sbi->nr_free_blocks);
+}
+
+/*
+ * Return an unused block number lower than limit and mark it used.
+ * Return 0 if no such block was found. Blocks held in CPU caches are not
+ * looked at.
+ */
+static inline uint32_t get_free_block_below(struct ouichefs_sb_info *sbi,
+					    uint32_t limit)
+{
+	return ouichefs_bitmap_alloc(sbi, &sbi->bfree, &sbi->nr_free_blocks,
+				     min(sbi->nr_blocks, limit));
+}
+
+/*
+ * Whether n blocks, or n inodes, are free. nr_free_blocks and nr_free_inodes
+ * leave out those held in CPU caches, use these instead.
+ */
+static inline bool has_free_blocks(struct ouichefs_sb_info *sbi, uint64_t n)
+{
+	return ouichefs_bitmap_has_free(&sbi->bfree, &sbi->nr_free_blocks, n);
+}
+
+static inline bool has_free_inodes(struct ouichefs_sb_info *sbi, uint64_t n)
+{
+	return ouichefs_bitmap_has_free(&sbi->ifree, &sbi->nr_free_inodes, n);
+}
+
+static inline uint32_t count_free_blocks(struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_bitmap_count_free(&sbi->bfree, &sbi->nr_free_blocks);
+}
+
+static inline uint32_t count_free_inodes(struct ouichefs_sb_info *sbi)
+{
+	return ouichefs_bitmap_count_free(&sbi->ifree, &sbi->nr_free_inodes);
+}
+
+/*
+ * Mark an inode as unused.
+ */
+static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	ouichefs_bitmap_put(sbi, &sbi->ifree, &sbi->nr_free_inodes, ino);
+}
+
+/*
+ * Mark a block as unused. With a journal, the block only goes back to the
+ * bitmap once the transaction freeing it is committed.
+ */
+static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	if (!ouichefs_journal_pin(sbi, bno))
+		ouichefs_bitmap_put(sbi, &sbi->bfree, &sbi->nr_free_blocks,
+				    bno);
+}
+
+/*
+ * Copy one block of on-disk little-endian bitmap to its in-memory version.
+ */
+static inline void copy_bitmap_from_le64(unsigned long *dst, __le64 *src,
+					 unsigned long block_size)
+{
+	uint64_t *d = (uint64_t *)dst;
+	unsigned int i;
+
+	for (i = 0; i < block_size / sizeof(uint64_t); i++)
+		d[i] = le64_to_cpu(src[i]);
+}
+
+/*
+ * Copy one block of in-memory bitmap to its on-disk little-endian version.
+ */
+static inline void copy_bitmap_to_le64(__le64 *dst, unsigned long *src,
+				       unsigned long block_size)
+{
+	uint64_t *s = (uint64_t *)src;
+	unsigned int i;
+
+	for (i = 0; i < block_size / sizeof(uint64_t); i++)
+		dst[i] = cpu_to_le64(s[i]);
+}
+
+#endif /* _OUICHEFS_BITMAP_H */
@@ -0,0 +1,1441 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Entries of a directory as found on disk: the buffer holding them, the first
+ * entry and the number of slots (used or not).
+ */
+struct ouichefs_dir_map {
+	struct buffer_head *bh;
+	struct ouichefs_file *files;
+	uint32_t nr_slots;
+};
+
+/*
+ * Read the storage of dir. Empty directories have no slot and no buffer.
+ * The buffer must be released by the caller.
+ */
+static int ouichefs_map_dir(struct inode *dir, struct ouichefs_dir_map *map)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	uint32_t offset = 0;
+
+	map->bh = NULL;
+	map->files = NULL;
+	map->nr_slots = 0;
+	if (!ci->index_block)
+		return 0;
+
+	if (ouichefs_is_sliced(dir)) {
+		offset = extract_slice_num(ci->index_block) * sbi->s_slice_size;
+		map->nr_slots = dir->i_size / sizeof(struct ouichefs_file);
+	} else {
+		map->nr_slots = OUICHEFS_DIR_BLOCK_ENTRIES(sb);
+	}
+
+	map->bh = sb_bread(sb, extract_block_num(ci->index_block));
+	if (!map->bh)
+		return -EIO;
+	map->files = (struct ouichefs_file *)(map->bh->b_data + offset);
+
+	return 0;
+}
+
+/* Number of used entries, they are packed at the beginning */
+static uint32_t ouichefs_count_entries(struct ouichefs_dir_map *map)
+{
+	uint32_t i;
+
+	for (i = 0; i < map->nr_slots; i++)
+		if (!map->files[i].inode)
+			break;
+	return i;
+}
+
+static bool ouichefs_match(const struct ouichefs_file *f,
+			   const struct qstr *name)
+{
+	return strnlen(f->filename, OUICHEFS_FILENAME_LEN) == name->len &&
+	       !memcmp(f->filename, name->name, name->len);
+}
+
+/* Return the slot of name in map, -ENOENT if there is none */
+static int ouichefs_find_slot(struct ouichefs_dir_map *map,
+			      const struct qstr *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < map->nr_slots; i++) {
+		if (!map->files[i].inode)
+			break;
+		if (ouichefs_match(&map->files[i], name))
+			return i;
+	}
+	return -ENOENT;
+}
+
+int ouichefs_cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Start reading the inode store blocks of the nr entries in files, readdir is
+ * usually followed by a lookup of each of them (ls -l, find, rsync). Blocks
+ * are sorted and submitted once each under a plug, so that the whole batch is
+ * merged into a few requests instead of one synchronous read per iget.
+ * Blocks already uptodate are skipped by sb_breadahead().
+ */
+static void ouichefs_readahead_inodes(struct super_block *sb,
+				      struct ouichefs_file *files, uint32_t nr)
+{
+	struct blk_plug plug;
+	uint32_t *blocks, i, n = 0;
+
+	if (nr < 2)
+		return;
+	blocks = kmalloc_array(nr, sizeof(uint32_t), GFP_NOFS);
+	if (!blocks)
+		return;
+
+	for (i = 0; i < nr && files[i].inode; i++)
+		blocks[n++] = le32_to_cpu(files[i].inode) /
+			      OUICHEFS_INODES_PER_BLOCK(sb) + 1;
+	sort(blocks, n, sizeof(uint32_t), ouichefs_cmp_u32, NULL);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		if (i && blocks[i] == blocks[i - 1])
+			continue;
+		sb_breadahead(sb, blocks[i]);
+	}
+	blk_finish_plug(&plug);
+
+	kfree(blocks);
+}
+
+/* Children of a directory whose sliced blocks are to be read ahead */
+struct ouichefs_prefetch {
+	struct work_struct work;
+	struct super_block *sb;
+	uint32_t nr;
+	uint32_t inos[];
+};
+
+/*
+ * Read the inodes of the children from the inode store, which readdir already
+ * started reading, and start reading the distinct sliced blocks they use.
+ */
+static void ouichefs_prefetch_work(struct work_struct *work)
+{
+	struct ouichefs_prefetch *p =
+		container_of(work, struct ouichefs_prefetch, work);
+	struct super_block *sb = p->sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh = NULL;
+	struct blk_plug plug;
+	uint32_t i, n = 0, iblock, last = 0;
+
+	/* Inodes sharing a store block are next to each other once sorted */
+	sort(p->inos, p->nr, sizeof(uint32_t), ouichefs_cmp_u32, NULL);
+	for (i = 0; i < p->nr; i++) {
+		iblock = p->inos[i] / OUICHEFS_INODES_PER_BLOCK(sb) + 1;
+		if (iblock != last) {
+			brelse(bh);
+			bh = sb_bread(sb, iblock);
+			last = bh ? iblock : 0;
+		}
+		if (!bh)
+			continue;
+		cinode = ouichefs_disk_inode(sb, bh, p->inos[i]);
+		if (!(le32_to_cpu(cinode->i_flags) & OUICHEFS_INODE_SLICED))
+			continue;
+		/* Sliced blocks reuse the array, n never passes i */
+		p->inos[n++] = extract_block_num(
+			ouichefs_get_disk_index(sbi, cinode));
+	}
+	brelse(bh);
+
+	sort(p->inos, n, sizeof(uint32_t), ouichefs_cmp_u32, NULL);
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		if (i && p->inos[i] == p->inos[i - 1])
+			continue;
+		sb_breadahead(sb, p->inos[i]);
+	}
+	blk_finish_plug(&plug);
+
+	kfree(p);
+}
+
+/*
+ * Small children are usually read right after the listing of their directory.
+ * Their sliced blocks are only known once their inodes are read, so this is
+ * left to a worker, readdir does not wait for it.
+ */
+static void ouichefs_prefetch_slices(struct super_block *sb,
+				     struct ouichefs_file *files, uint32_t nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_prefetch *p;
+	uint32_t i;
+
+	for (i = 0; i < nr && files[i].inode; i++)
+		;
+	if (!i)
+		return;
+	p = kmalloc(struct_size(p, inos, i), GFP_NOFS | __GFP_NOWARN);
+	if (!p)
+		return;
+	INIT_WORK(&p->work, ouichefs_prefetch_work);
+	p->sb = sb;
+	p->nr = i;
+	for (i = 0; i < p->nr; i++)
+		p->inos[i] = le32_to_cpu(files[i].inode);
+	queue_work(sbi->wq, &p->work);
+}
+
+/* Readahead for the nr entries of files that readdir is about to emit */
+static void ouichefs_readahead_children(struct super_block *sb,
+					struct ouichefs_file *files,
+					uint32_t nr)
+{
+	ouichefs_readahead_inodes(sb, files, nr);
+	ouichefs_prefetch_slices(sb, files, nr);
+}
+
+static void ouichefs_dx_release(struct inode *dir);
+
+/*
+ * Free the storage of dir, whatever entries it still holds. Slices and blocks
+ * freed are pinned by the journal until the running transaction is committed.
+ */
+void ouichefs_release_dir(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+
+	if (ouichefs_is_sliced(dir))
+		ouichefs_free_slices(sb, extract_block_num(ci->index_block),
+				     extract_slice_num(ci->index_block),
+				     dir->i_size / sbi->s_slice_size);
+	else if (ci->i_flags & OUICHEFS_INODE_INDEXED)
+		ouichefs_dx_release(dir);
+	else if (ci->index_block)
+		put_block(sbi, ci->index_block);
+
+	ci->index_block = 0;
+	ci->i_flags &= ~(OUICHEFS_INODE_SLICED | OUICHEFS_INODE_INDEXED);
+	dir->i_size = 0;
+	mark_inode_dirty(dir);
+}
+
+/*
+ * Move the entries of a full directory to a larger storage: a slice run twice
+ * as large, or a block of its own once the run would fill half a block.
+ */
+static int ouichefs_grow_dir(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	struct ouichefs_dir_map old;
+	struct buffer_head *bh;
+	uint32_t size, bno, slice = 0, offset = 0;
+	uint64_t index;
+	int ret;
+
+	/* Block directories cannot grow */
+	if (ci->index_block && !ouichefs_is_sliced(dir))
+		return -EMLINK;
+
+	size = max_t(uint32_t, dir->i_size * 2, sbi->s_slice_size);
+	if (size <= sb->s_blocksize / 2) {
+		/* Stay next to the files of the directory */
+		ret = ouichefs_alloc_slices(sb, size / sbi->s_slice_size,
+					    ouichefs_slice_hint(dir), &bno,
+					    &slice);
+		if (ret)
+			return ret;
+		offset = slice * sbi->s_slice_size;
+		index = pack_slice_ptr(bno, slice);
+	} else {
+		bno = ouichefs_alloc_block(sb);
+		if (!bno)
+			return -ENOSPC;
+		size = sb->s_blocksize;
+		index = bno;
+	}
+
+	ret = ouichefs_map_dir(dir, &old);
+	if (ret)
+		goto free_new;
+	bh = sb_bread(sb, bno);
+	if (!bh) {
+		ret = -EIO;
+		brelse(old.bh);
+		goto free_new;
+	}
+	memset(bh->b_data + offset, 0, size);
+	if (old.nr_slots)
+		memcpy(bh->b_data + offset, old.files,
+		       old.nr_slots * sizeof(struct ouichefs_file));
+	ouichefs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+	brelse(old.bh);
+
+	/*
+	 * The entries are safe in their new home, give the old one back. With
+	 * a journal, it stays allocated until the switch is committed, the
+	 * last commit may still point dir to it.
+	 */
+	ouichefs_release_dir(dir);
+	ci->index_block = index;
+	if (size < sb->s_blocksize)
+		ci->i_flags |= OUICHEFS_INODE_SLICED;
+	dir->i_size = size;
+	mark_inode_dirty(dir);
+
+	return 0;
+
+free_new:
+	if (size < sb->s_blocksize)
+		ouichefs_free_slices(sb, bno, slice, size / sbi->s_slice_size);
+	else
+		put_block(sbi, bno);
+	return ret;
+}
+
+/*
+ * Hashed directories, see struct ouichefs_dx_node.
+ */
+
+struct ouichefs_dx_frame {
+	struct buffer_head *bh;
+	struct ouichefs_dx_node *node;
+	uint32_t pos; /* Entry followed to the next level */
+};
+
+/* FNV-1a, stable across reboots unlike full_name_hash() */
+static uint32_t ouichefs_dx_hash(const struct qstr *name)
+{
+	uint32_t hash = 2166136261U;
+	unsigned int i;
+
+	for (i = 0; i < name->len; i++) {
+		hash ^= (u8)name->name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#define OUICHEFS_DX_TAG(hash) ((hash) & 0xff)
+
+/*
+ * readdir cookie of an entry, its position is 2 + cookie. The hash ordering
+ * the index comes first, then 30 bits of a second hash to order the names
+ * sharing it. Cookies only depend on names, so splits and removals moving
+ * entries around the leaves don't make a listing skip or repeat them.
+ */
+static u64 ouichefs_dx_cookie(const struct qstr *name, uint32_t hash)
+{
+	return (u64)hash << 30 | (jhash(name->name, name->len, 0) & 0x3fffffff);
+}
+
+/* Number of (hash, block) pairs in an index node */
+static inline uint32_t ouichefs_dx_limit(struct super_block *sb)
+{
+	return (sb->s_blocksize - sizeof(struct ouichefs_dx_node)) /
+	       sizeof(struct ouichefs_dx_entry);
+}
+
+/* Number of entries in a leaf, a multiple of 4 to keep entries aligned */
+static inline uint32_t ouichefs_dx_leaf_slots(struct super_block *sb)
+{
+	return ((sb->s_blocksize - sizeof(struct ouichefs_dx_leaf)) /
+		(1 + sizeof(struct ouichefs_file))) & ~3U;
+}
+
+static inline struct ouichefs_file *
+ouichefs_dx_leaf_files(struct super_block *sb, struct ouichefs_dx_leaf *leaf)
+{
+	return (struct ouichefs_file *)(leaf->tags + ouichefs_dx_leaf_slots(sb));
+}
+
+static void ouichefs_dx_release_frames(struct ouichefs_dx_frame *frames, int nr)
+{
+	while (nr--)
+		brelse(frames[nr].bh);
+}
+
+/* Index of the last entry of node whose hash is lower or equal to hash */
+static uint32_t ouichefs_dx_search(struct ouichefs_dx_node *node,
+				   uint32_t hash)
+{
+	uint32_t lo = 1, hi = le16_to_cpu(node->count), mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(node->entries[mid].hash) <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/*
+ * Walk the index of dir down to the leaf covering hash. The index nodes of the
+ * path are returned in frames and must be released by the caller.
+ */
+static int ouichefs_dx_probe(struct inode *dir, uint32_t hash,
+			     struct ouichefs_dx_frame *frames, int *nr_frames,
+			     uint32_t *leaf)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_frame *frame;
+	uint32_t bno = OUICHEFS_INODE(dir)->index_block;
+	int i, levels = 0;
+
+	for (i = 0; i <= levels; i++) {
+		frame = &frames[i];
+		frame->bh = sb_bread(sb, bno);
+		if (!frame->bh) {
+			ouichefs_dx_release_frames(frames, i);
+			return -EIO;
+		}
+		frame->node = (struct ouichefs_dx_node *)frame->bh->b_data;
+		if (!i)
+			levels = min_t(int, frame->node->levels,
+				       OUICHEFS_DX_MAX_LEVELS - 1);
+		frame->pos = ouichefs_dx_search(frame->node, hash);
+		bno = le32_to_cpu(frame->node->entries[frame->pos].block);
+	}
+	*nr_frames = i;
+	*leaf = bno;
+
+	return 0;
+}
+
+/* Allocate a zeroed block for the index of dir */
+static struct buffer_head *ouichefs_dx_new_block(struct inode *dir,
+						 uint32_t *bno)
+{
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh;
+
+	*bno = ouichefs_alloc_block(sb);
+	if (!*bno)
+		return ERR_PTR(-ENOSPC);
+	bh = sb_getblk(sb, *bno);
+	if (!bh) {
+		put_block(OUICHEFS_SB(sb), *bno);
+		return ERR_PTR(-EIO);
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ouichefs_journal_dirty(dir->i_sb, bh);
+
+	dir->i_size += sb->s_blocksize;
+	mark_inode_dirty(dir);
+
+	return bh;
+}
+
+/* Insert (hash, bno) in the node of frame, right after the followed entry */
+static void ouichefs_dx_insert(struct super_block *sb,
+			       struct ouichefs_dx_frame *frame, uint32_t hash,
+			       uint32_t bno)
+{
+	struct ouichefs_dx_node *node = frame->node;
+	uint32_t count = le16_to_cpu(node->count), at = frame->pos + 1;
+
+	memmove(&node->entries[at + 1], &node->entries[at],
+		(count - at) * sizeof(struct ouichefs_dx_entry));
+	node->entries[at].hash = cpu_to_le32(hash);
+	node->entries[at].block = cpu_to_le32(bno);
+	node->count = cpu_to_le16(count + 1);
+	ouichefs_journal_dirty(sb, frame->bh);
+}
+
+/*
+ * Move the upper half of the hashes of the full leaf in bh to a new leaf,
+ * referenced from the node of parent.
+ */
+static int ouichefs_dx_split_leaf(struct inode *dir,
+				  struct ouichefs_dx_frame *parent,
+				  struct buffer_head *bh)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_leaf *leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+	struct ouichefs_file *files = ouichefs_dx_leaf_files(sb, leaf);
+	struct ouichefs_dx_leaf *new_leaf;
+	struct ouichefs_file *new_files;
+	struct buffer_head *new_bh;
+	uint32_t nr = le32_to_cpu(leaf->nr), *hashes, *sorted;
+	uint32_t i, mid, split, bno, kept = 0, moved = 0;
+	int ret = 0;
+
+	hashes = kmalloc_array(nr * 2, sizeof(uint32_t), GFP_KERNEL);
+	if (!hashes)
+		return -ENOMEM;
+	sorted = hashes + nr;
+	for (i = 0; i < nr; i++) {
+		struct qstr name = QSTR_INIT(files[i].filename,
+			strnlen(files[i].filename, OUICHEFS_FILENAME_LEN));
+
+		hashes[i] = sorted[i] = ouichefs_dx_hash(&name);
+	}
+	sort(sorted, nr, sizeof(uint32_t), ouichefs_cmp_u32, NULL);
+
+	/* Split close to the middle, names with the same hash stay together */
+	mid = nr / 2;
+	while (mid > 0 && sorted[mid - 1] == sorted[mid])
+		mid--;
+	if (!mid) {
+		mid = nr / 2;
+		while (mid < nr && sorted[mid] == sorted[0])
+			mid++;
+	}
+	if (mid == nr) {
+		ret = -EMLINK;
+		goto out;
+	}
+	split = sorted[mid];
+
+	new_bh = ouichefs_dx_new_block(dir, &bno);
+	if (IS_ERR(new_bh)) {
+		ret = PTR_ERR(new_bh);
+		goto out;
+	}
+	new_leaf = (struct ouichefs_dx_leaf *)new_bh->b_data;
+	new_files = ouichefs_dx_leaf_files(sb, new_leaf);
+
+	for (i = 0; i < nr; i++) {
+		if (hashes[i] >= split) {
+			new_files[moved] = files[i];
+			new_leaf->tags[moved++] = leaf->tags[i];
+		} else {
+			files[kept] = files[i];
+			leaf->tags[kept++] = leaf->tags[i];
+		}
+	}
+	memset(&files[kept], 0, moved * sizeof(struct ouichefs_file));
+	memset(&leaf->tags[kept], 0, moved);
+	leaf->nr = cpu_to_le32(kept);
+	new_leaf->nr = cpu_to_le32(moved);
+	ouichefs_journal_dirty(dir->i_sb, bh);
+	ouichefs_journal_dirty(dir->i_sb, new_bh);
+	brelse(new_bh);
+
+	ouichefs_dx_insert(dir->i_sb, parent, split, bno);
+out:
+	kfree(hashes);
+	return ret;
+}
+
+/* Move the upper half of the full interior node of frame to a new node */
+static int ouichefs_dx_split_node(struct inode *dir,
+				  struct ouichefs_dx_frame *parent,
+				  struct ouichefs_dx_frame *frame)
+{
+	struct ouichefs_dx_node *node = frame->node, *new_node;
+	struct buffer_head *new_bh;
+	uint32_t count = le16_to_cpu(node->count), half = count / 2, bno;
+
+	new_bh = ouichefs_dx_new_block(dir, &bno);
+	if (IS_ERR(new_bh))
+		return PTR_ERR(new_bh);
+	new_node = (struct ouichefs_dx_node *)new_bh->b_data;
+
+	memcpy(new_node->entries, &node->entries[half],
+	       (count - half) * sizeof(struct ouichefs_dx_entry));
+	new_node->count = cpu_to_le16(count - half);
+	memset(&node->entries[half], 0,
+	       (count - half) * sizeof(struct ouichefs_dx_entry));
+	node->count = cpu_to_le16(half);
+	ouichefs_journal_dirty(dir->i_sb, frame->bh);
+	ouichefs_journal_dirty(dir->i_sb, new_bh);
+	brelse(new_bh);
+
+	ouichefs_dx_insert(dir->i_sb, parent,
+			   le32_to_cpu(new_node->entries[0].hash), bno);
+
+	return 0;
+}
+
+/* Move the entries of the full root to a new node, one level down */
+static int ouichefs_dx_add_level(struct inode *dir,
+				 struct ouichefs_dx_frame *root)
+{
+	struct ouichefs_dx_node *new_node;
+	struct buffer_head *new_bh;
+	uint32_t count = le16_to_cpu(root->node->count), bno;
+
+	new_bh = ouichefs_dx_new_block(dir, &bno);
+	if (IS_ERR(new_bh))
+		return PTR_ERR(new_bh);
+	new_node = (struct ouichefs_dx_node *)new_bh->b_data;
+
+	memcpy(new_node->entries, root->node->entries,
+	       count * sizeof(struct ouichefs_dx_entry));
+	new_node->count = cpu_to_le16(count);
+	ouichefs_journal_dirty(dir->i_sb, new_bh);
+	brelse(new_bh);
+
+	memset(root->node->entries, 0,
+	       count * sizeof(struct ouichefs_dx_entry));
+	root->node->entries[0].block = cpu_to_le32(bno);
+	root->node->count = cpu_to_le16(1);
+	root->node->levels++;
+	ouichefs_journal_dirty(dir->i_sb, root->bh);
+
+	return 0;
+}
+
+/*
+ * The leaf in bh is full. Split it, or first make room in the index for the
+ * new leaf. The caller probes again afterwards.
+ */
+static int ouichefs_dx_make_room(struct inode *dir,
+				 struct ouichefs_dx_frame *frames, int nr_frames,
+				 struct buffer_head *bh)
+{
+	struct ouichefs_dx_frame *parent = &frames[nr_frames - 1];
+	uint32_t limit = ouichefs_dx_limit(dir->i_sb);
+
+	if (le16_to_cpu(parent->node->count) < limit)
+		return ouichefs_dx_split_leaf(dir, parent, bh);
+
+	/* The full parent is the root, push its entries one level down */
+	if (nr_frames == 1) {
+		if (frames[0].node->levels + 1 >= OUICHEFS_DX_MAX_LEVELS)
+			return -EMLINK;
+		return ouichefs_dx_add_level(dir, &frames[0]);
+	}
+
+	/* Split the full interior node, its parent has to take the new one */
+	if (le16_to_cpu(frames[nr_frames - 2].node->count) >= limit)
+		return -EMLINK;
+	return ouichefs_dx_split_node(dir, &frames[nr_frames - 2], parent);
+}
+
+/* Return the slot of name in leaf, -ENOENT if there is none */
+static int ouichefs_dx_find_slot(struct super_block *sb,
+				 struct ouichefs_dx_leaf *leaf,
+				 const struct qstr *name, uint32_t hash)
+{
+	struct ouichefs_file *files = ouichefs_dx_leaf_files(sb, leaf);
+	uint32_t i, nr = le32_to_cpu(leaf->nr);
+
+	for (i = 0; i < nr; i++) {
+		if (leaf->tags[i] != OUICHEFS_DX_TAG(hash))
+			continue;
+		if (ouichefs_match(&files[i], name))
+			return i;
+	}
+	return -ENOENT;
+}
+
+static int ouichefs_dx_find(struct inode *dir, const struct qstr *name,
+			    uint32_t *ino)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_frame frames[OUICHEFS_DX_MAX_LEVELS];
+	struct ouichefs_dx_leaf *leaf;
+	struct buffer_head *bh;
+	uint32_t hash = ouichefs_dx_hash(name), bno;
+	int ret, nr_frames;
+
+	ret = ouichefs_dx_probe(dir, hash, frames, &nr_frames, &bno);
+	if (ret)
+		return ret;
+	ouichefs_dx_release_frames(frames, nr_frames);
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+	ret = ouichefs_dx_find_slot(sb, leaf, name, hash);
+	if (ret >= 0) {
+		*ino = le32_to_cpu(ouichefs_dx_leaf_files(sb, leaf)[ret].inode);
+		ret = 0;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+static int ouichefs_dx_add(struct inode *dir, const struct qstr *name,
+			   uint32_t ino)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_frame frames[OUICHEFS_DX_MAX_LEVELS];
+	struct ouichefs_dx_leaf *leaf;
+	struct ouichefs_file *f;
+	struct buffer_head *bh;
+	uint32_t hash = ouichefs_dx_hash(name), bno, nr;
+	int ret, nr_frames;
+
+	for (;;) {
+		ret = ouichefs_dx_probe(dir, hash, frames, &nr_frames, &bno);
+		if (ret)
+			return ret;
+		bh = sb_bread(sb, bno);
+		if (!bh) {
+			ouichefs_dx_release_frames(frames, nr_frames);
+			return -EIO;
+		}
+		leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+		nr = le32_to_cpu(leaf->nr);
+		if (nr < ouichefs_dx_leaf_slots(sb))
+			break;
+
+		ret = ouichefs_dx_make_room(dir, frames, nr_frames, bh);
+		brelse(bh);
+		ouichefs_dx_release_frames(frames, nr_frames);
+		if (ret)
+			return ret;
+	}
+
+	f = &ouichefs_dx_leaf_files(sb, leaf)[nr];
+	f->inode = cpu_to_le32(ino);
+	memset(f->filename, 0, OUICHEFS_FILENAME_LEN);
+	memcpy(f->filename, name->name, name->len);
+	leaf->tags[nr] = OUICHEFS_DX_TAG(hash);
+	leaf->nr = cpu_to_le32(nr + 1);
+	ouichefs_journal_dirty(dir->i_sb, bh);
+	brelse(bh);
+
+	le32_add_cpu(&frames[0].node->nr_files, 1);
+	ouichefs_journal_dirty(dir->i_sb, frames[0].bh);
+	ouichefs_dx_release_frames(frames, nr_frames);
+
+	return 0;
+}
+
+static int ouichefs_dx_remove(struct inode *dir, const struct qstr *name)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_frame frames[OUICHEFS_DX_MAX_LEVELS];
+	struct ouichefs_dx_leaf *leaf;
+	struct ouichefs_file *files;
+	struct buffer_head *bh;
+	uint32_t hash = ouichefs_dx_hash(name), bno, nr;
+	int ret, nr_frames, slot;
+
+	ret = ouichefs_dx_probe(dir, hash, frames, &nr_frames, &bno);
+	if (ret)
+		return ret;
+	bh = sb_bread(sb, bno);
+	if (!bh) {
+		ret = -EIO;
+		goto release;
+	}
+	leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+	slot = ouichefs_dx_find_slot(sb, leaf, name, hash);
+	if (slot < 0) {
+		ret = slot;
+		goto brelse;
+	}
+
+	/* Keep used entries packed */
+	files = ouichefs_dx_leaf_files(sb, leaf);
+	nr = le32_to_cpu(leaf->nr);
+	memmove(&files[slot], &files[slot + 1],
+		(nr - slot - 1) * sizeof(struct ouichefs_file));
+	memmove(&leaf->tags[slot], &leaf->tags[slot + 1], nr - slot - 1);
+	memset(&files[nr - 1], 0, sizeof(struct ouichefs_file));
+	leaf->tags[nr - 1] = 0;
+	leaf->nr = cpu_to_le32(nr - 1);
+	ouichefs_journal_dirty(dir->i_sb, bh);
+
+	le32_add_cpu(&frames[0].node->nr_files, -1);
+	ouichefs_journal_dirty(dir->i_sb, frames[0].bh);
+brelse:
+	brelse(bh);
+release:
+	ouichefs_dx_release_frames(frames, nr_frames);
+	return ret;
+}
+
+static int ouichefs_dx_set(struct inode *dir, const struct qstr *name,
+			   uint32_t ino)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_frame frames[OUICHEFS_DX_MAX_LEVELS];
+	struct ouichefs_dx_leaf *leaf;
+	struct buffer_head *bh;
+	uint32_t hash = ouichefs_dx_hash(name), bno;
+	int ret, nr_frames;
+
+	ret = ouichefs_dx_probe(dir, hash, frames, &nr_frames, &bno);
+	if (ret)
+		return ret;
+	ouichefs_dx_release_frames(frames, nr_frames);
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+	ret = ouichefs_dx_find_slot(sb, leaf, name, hash);
+	if (ret >= 0) {
+		ouichefs_dx_leaf_files(sb, leaf)[ret].inode = cpu_to_le32(ino);
+		ouichefs_journal_dirty(dir->i_sb, bh);
+		ret = 0;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/* Free all the blocks of the index of dir, whatever entries they hold */
+static void ouichefs_dx_release(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_dx_node *root, *node;
+	struct buffer_head *bh, *bh_node;
+	uint32_t root_bno = OUICHEFS_INODE(dir)->index_block, bno;
+	uint32_t r, n;
+
+	bh = sb_bread(sb, root_bno);
+	if (!bh)
+		goto put_root;
+	root = (struct ouichefs_dx_node *)bh->b_data;
+	for (r = 0; r < le16_to_cpu(root->count); r++) {
+		bno = le32_to_cpu(root->entries[r].block);
+		if (root->levels) {
+			bh_node = sb_bread(sb, bno);
+			if (!bh_node)
+				goto put_node;
+			node = (struct ouichefs_dx_node *)bh_node->b_data;
+			for (n = 0; n < le16_to_cpu(node->count); n++)
+				put_block(sbi, le32_to_cpu(node->entries[n].block));
+			brelse(bh_node);
+		}
+put_node:
+		put_block(sbi, bno);
+	}
+	brelse(bh);
+put_root:
+	put_block(sbi, root_bno);
+}
+
+/* Order (hash << 32 | slot) keys, see ouichefs_dx_convert() */
+static int ouichefs_dx_cmp_key(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Turn the full block directory dir into a hashed directory. The root and the
+ * leaves are filled on new blocks before dir is switched to them, so that
+ * dir is left untouched if this fails.
+ */
+static int ouichefs_dx_convert(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	uint32_t slots = ouichefs_dx_leaf_slots(sb);
+	struct ouichefs_dx_leaf *leaf = NULL;
+	struct ouichefs_dx_node *root;
+	struct ouichefs_dir_map map;
+	struct buffer_head *bh, *bh_leaf = NULL;
+	uint32_t i, nr, hash, prev = 0, count = 0, root_bno, bno;
+	uint32_t old_bno = ci->index_block;
+	u64 *keys;
+	int ret;
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+	nr = ouichefs_count_entries(&map);
+	keys = kmalloc_array(nr, sizeof(u64), GFP_KERNEL);
+	if (!keys) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nr; i++) {
+		struct qstr name = QSTR_INIT(map.files[i].filename,
+			strnlen(map.files[i].filename, OUICHEFS_FILENAME_LEN));
+
+		keys[i] = (u64)ouichefs_dx_hash(&name) << 32 | i;
+	}
+	sort(keys, nr, sizeof(u64), ouichefs_dx_cmp_key, NULL);
+
+	dir->i_size = 0;
+	bh = ouichefs_dx_new_block(dir, &root_bno);
+	if (IS_ERR(bh)) {
+		ret = PTR_ERR(bh);
+		goto restore;
+	}
+	root = (struct ouichefs_dx_node *)bh->b_data;
+
+	/*
+	 * Entries go to the leaves in hash order. Leaves are closed half full
+	 * to leave room for new names, names with the same hash stay together.
+	 * A block worth of entries needs a few leaves, the root has room.
+	 */
+	for (i = 0; i < nr; i++) {
+		uint32_t n;
+
+		hash = keys[i] >> 32;
+		if (!leaf || (le32_to_cpu(leaf->nr) >= slots / 2 && hash != prev)) {
+			if (bh_leaf) {
+				ouichefs_journal_dirty(sb, bh_leaf);
+				brelse(bh_leaf);
+			}
+			bh_leaf = ouichefs_dx_new_block(dir, &bno);
+			if (IS_ERR(bh_leaf)) {
+				ret = PTR_ERR(bh_leaf);
+				bh_leaf = NULL;
+				goto fail;
+			}
+			leaf = (struct ouichefs_dx_leaf *)bh_leaf->b_data;
+			root->entries[count].hash = cpu_to_le32(count ? hash : 0);
+			root->entries[count].block = cpu_to_le32(bno);
+			count++;
+		}
+		n = le32_to_cpu(leaf->nr);
+		if (n == slots) {
+			ret = -EMLINK;
+			goto fail;
+		}
+		ouichefs_dx_leaf_files(sb, leaf)[n] = map.files[keys[i] & U32_MAX];
+		leaf->tags[n] = OUICHEFS_DX_TAG(hash);
+		leaf->nr = cpu_to_le32(n + 1);
+		prev = hash;
+	}
+	ouichefs_journal_dirty(sb, bh_leaf);
+	brelse(bh_leaf);
+	root->count = cpu_to_le16(count);
+	root->nr_files = cpu_to_le32(nr);
+	ouichefs_journal_dirty(sb, bh);
+	brelse(bh);
+
+	ci->index_block = root_bno;
+	ci->i_flags |= OUICHEFS_INODE_INDEXED;
+	mark_inode_dirty(dir);
+	put_block(sbi, old_bno);
+	goto out;
+
+fail:
+	brelse(bh_leaf);
+	for (i = 0; i < count; i++)
+		put_block(sbi, le32_to_cpu(root->entries[i].block));
+	brelse(bh);
+	put_block(sbi, root_bno);
+restore:
+	dir->i_size = sb->s_blocksize;
+	mark_inode_dirty(dir);
+out:
+	kfree(keys);
+	brelse(map.bh);
+	return ret;
+}
+
+/* An entry of a leaf and its cookie, see ouichefs_dx_cookie() */
+struct ouichefs_dx_slot {
+	u64 cookie;
+	uint32_t slot;
+};
+
+static int ouichefs_dx_cmp_slot(const void *a, const void *b)
+{
+	u64 x = ((const struct ouichefs_dx_slot *)a)->cookie;
+	u64 y = ((const struct ouichefs_dx_slot *)b)->cookie;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Commit the entries of the leaf bno whose cookie is not below ctx->pos - 2 to
+ * ctx, in cookie order. slots has room for a leaf. Return 1 if ctx is full.
+ */
+static int ouichefs_dx_emit_leaf(struct super_block *sb,
+				 struct dir_context *ctx, uint32_t bno,
+				 struct ouichefs_dx_slot *slots)
+{
+	struct ouichefs_dx_leaf *leaf;
+	struct ouichefs_file *files, *f;
+	struct buffer_head *bh;
+	u64 start = ctx->pos - 2, cookie;
+	uint32_t i, nr, count = 0;
+	int ret = 0;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+	files = ouichefs_dx_leaf_files(sb, leaf);
+	nr = le32_to_cpu(leaf->nr);
+	for (i = 0; i < nr; i++) {
+		struct qstr name = QSTR_INIT(files[i].filename,
+			strnlen(files[i].filename, OUICHEFS_FILENAME_LEN));
+
+		cookie = ouichefs_dx_cookie(&name, ouichefs_dx_hash(&name));
+		if (cookie < start)
+			continue;
+		slots[count].cookie = cookie;
+		slots[count++].slot = i;
+	}
+	/* Once per leaf, later calls resume within it */
+	if (count == nr)
+		ouichefs_readahead_children(sb, files, nr);
+	sort(slots, count, sizeof(*slots), ouichefs_dx_cmp_slot, NULL);
+
+	for (i = 0; i < count; i++) {
+		f = &files[slots[i].slot];
+		if (!dir_emit(ctx, f->filename,
+			      strnlen(f->filename, OUICHEFS_FILENAME_LEN),
+			      le32_to_cpu(f->inode), DT_UNKNOWN)) {
+			ret = 1;
+			break;
+		}
+		ctx->pos = 2 + slots[i].cookie + 1;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Commit the entries of the hashed directory dir to ctx, in cookie order.
+ * The listing resumes at the leaf covering the hash of the cookie in ctx.
+ */
+static int ouichefs_dx_iterate(struct inode *dir, struct dir_context *ctx)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_node *root, *node;
+	struct ouichefs_dx_slot *slots;
+	struct buffer_head *bh, *bh_node;
+	uint32_t hash = (ctx->pos - 2) >> 30, r, n;
+	int ret = 0;
+
+	slots = kmalloc_array(ouichefs_dx_leaf_slots(sb), sizeof(*slots),
+			      GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh) {
+		ret = -EIO;
+		goto out;
+	}
+	root = (struct ouichefs_dx_node *)bh->b_data;
+
+	for (r = ouichefs_dx_search(root, hash); r < le16_to_cpu(root->count);
+	     r++) {
+		uint32_t bno = le32_to_cpu(root->entries[r].block);
+
+		if (!root->levels) {
+			ret = ouichefs_dx_emit_leaf(sb, ctx, bno, slots);
+			if (ret)
+				break;
+			continue;
+		}
+
+		bh_node = sb_bread(sb, bno);
+		if (!bh_node) {
+			ret = -EIO;
+			break;
+		}
+		node = (struct ouichefs_dx_node *)bh_node->b_data;
+		for (n = ouichefs_dx_search(node, hash);
+		     n < le16_to_cpu(node->count); n++) {
+			ret = ouichefs_dx_emit_leaf(sb, ctx,
+				le32_to_cpu(node->entries[n].block), slots);
+			if (ret)
+				break;
+		}
+		brelse(bh_node);
+		if (ret)
+			break;
+	}
+	brelse(bh);
+out:
+	kfree(slots);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Look for name in dir and return its inode number in ino.
+ * Return -ENOENT if dir has no such entry.
+ */
+int ouichefs_find_entry(struct inode *dir, const struct qstr *name,
+			uint32_t *ino)
+{
+	struct ouichefs_dir_map map;
+	int ret;
+
+	if (ouichefs_is_indexed(dir))
+		return ouichefs_dx_find(dir, name, ino);
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+
+	ret = ouichefs_find_slot(&map, name);
+	if (ret >= 0) {
+		*ino = le32_to_cpu(map.files[ret].inode);
+		ret = 0;
+	}
+	brelse(map.bh);
+
+	return ret;
+}
+
+/*
+ * Add an entry for ino named name in dir, growing dir if it is full. The
+ * caller makes sure that name is not already used.
+ */
+int ouichefs_add_entry(struct inode *dir, const struct qstr *name,
+		       uint32_t ino)
+{
+	struct ouichefs_dir_map map;
+	struct ouichefs_file *f;
+	uint32_t nr;
+	int ret;
+
+	if (name->len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	if (ouichefs_is_indexed(dir))
+		return ouichefs_dx_add(dir, name, ino);
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+	nr = ouichefs_count_entries(&map);
+	if (nr == map.nr_slots) {
+		brelse(map.bh);
+		/* A full block directory gets a hash index */
+		if (ouichefs_is_sliced(dir) || !nr) {
+			ret = ouichefs_grow_dir(dir);
+		} else {
+			ret = ouichefs_dx_convert(dir);
+			if (!ret)
+				ret = ouichefs_dx_add(dir, name, ino);
+			return ret;
+		}
+		if (ret)
+			return ret;
+		ret = ouichefs_map_dir(dir, &map);
+		if (ret)
+			return ret;
+	}
+
+	f = &map.files[nr];
+	f->inode = cpu_to_le32(ino);
+	memset(f->filename, 0, OUICHEFS_FILENAME_LEN);
+	memcpy(f->filename, name->name, name->len);
+	ouichefs_journal_dirty(dir->i_sb, map.bh);
+	brelse(map.bh);
+
+	return 0;
+}
+
+/*
+ * Remove the entry named name from dir. A sliced directory left empty gives
+ * its slices back.
+ */
+int ouichefs_remove_entry(struct inode *dir, const struct qstr *name)
+{
+	struct ouichefs_dir_map map;
+	uint32_t nr;
+	int ret, f_id;
+
+	if (ouichefs_is_indexed(dir))
+		return ouichefs_dx_remove(dir, name);
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+
+	f_id = ouichefs_find_slot(&map, name);
+	if (f_id < 0) {
+		brelse(map.bh);
+		return f_id;
+	}
+	nr = ouichefs_count_entries(&map);
+
+	/* Keep used entries packed */
+	memmove(map.files + f_id, map.files + f_id + 1,
+		(nr - f_id - 1) * sizeof(struct ouichefs_file));
+	memset(&map.files[nr - 1], 0, sizeof(struct ouichefs_file));
+	ouichefs_journal_dirty(dir->i_sb, map.bh);
+	brelse(map.bh);
+
+	if (nr == 1 && ouichefs_is_sliced(dir))
+		ouichefs_release_dir(dir);
+
+	return 0;
+}
+
+/*
+ * Make the existing entry named name in dir point to ino. This only rewrites
+ * the entry in place, the name never disappears from dir.
+ */
+int ouichefs_set_entry(struct inode *dir, const struct qstr *name,
+		       uint32_t ino)
+{
+	struct ouichefs_dir_map map;
+	int ret;
+
+	if (ouichefs_is_indexed(dir))
+		return ouichefs_dx_set(dir, name, ino);
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+
+	ret = ouichefs_find_slot(&map, name);
+	if (ret >= 0) {
+		map.files[ret].inode = cpu_to_le32(ino);
+		ouichefs_journal_dirty(dir->i_sb, map.bh);
+		ret = 0;
+	}
+	brelse(map.bh);
+
+	return ret;
+}
+
+/* Append the entries of the leaf bno to files, which has room for max */
+static int ouichefs_dx_copy_leaf(struct super_block *sb, uint32_t bno,
+				 struct ouichefs_file *files, uint32_t *nr,
+				 uint32_t max)
+{
+	struct ouichefs_dx_leaf *leaf;
+	struct buffer_head *bh;
+	uint32_t n;
+
+	bh = sb_bread(sb, bno);
+	if (!bh)
+		return -EIO;
+	leaf = (struct ouichefs_dx_leaf *)bh->b_data;
+	n = min(le32_to_cpu(leaf->nr), max - *nr);
+	memcpy(files + *nr, ouichefs_dx_leaf_files(sb, leaf),
+	       n * sizeof(struct ouichefs_file));
+	*nr += n;
+	brelse(bh);
+
+	return 0;
+}
+
+static int ouichefs_dx_entries(struct inode *dir, struct ouichefs_file **files,
+			       uint32_t *nr)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_dx_node *root, *node;
+	struct buffer_head *bh, *bh_node;
+	uint32_t r, n, max;
+	int ret = 0;
+
+	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
+	if (!bh)
+		return -EIO;
+	root = (struct ouichefs_dx_node *)bh->b_data;
+	max = le32_to_cpu(root->nr_files);
+	*nr = 0;
+	*files = kvmalloc_array(max(max, 1U), sizeof(struct ouichefs_file),
+				GFP_KERNEL);
+	if (!*files) {
+		brelse(bh);
+		return -ENOMEM;
+	}
+
+	for (r = 0; !ret && r < le16_to_cpu(root->count); r++) {
+		uint32_t bno = le32_to_cpu(root->entries[r].block);
+
+		if (!root->levels) {
+			ret = ouichefs_dx_copy_leaf(sb, bno, *files, nr, max);
+			continue;
+		}
+		bh_node = sb_bread(sb, bno);
+		if (!bh_node) {
+			ret = -EIO;
+			break;
+		}
+		node = (struct ouichefs_dx_node *)bh_node->b_data;
+		for (n = 0; !ret && n < le16_to_cpu(node->count); n++)
+			ret = ouichefs_dx_copy_leaf(sb,
+				le32_to_cpu(node->entries[n].block),
+				*files, nr, max);
+		brelse(bh_node);
+	}
+	brelse(bh);
+
+	if (ret)
+		kvfree(*files);
+	return ret;
+}
+
+/*
+ * Return a copy of all the entries of dir in files, to be freed with kvfree(),
+ * and their number in nr.
+ */
+int ouichefs_dir_entries(struct inode *dir, struct ouichefs_file **files,
+			 uint32_t *nr)
+{
+	struct ouichefs_dir_map map;
+	int ret;
+
+	if (ouichefs_is_indexed(dir))
+		return ouichefs_dx_entries(dir, files, nr);
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+	*nr = ouichefs_count_entries(&map);
+	*files = kvmalloc_array(max(*nr, 1U), sizeof(struct ouichefs_file),
+				GFP_KERNEL);
+	if (*files && *nr)
+		memcpy(*files, map.files, *nr * sizeof(struct ouichefs_file));
+	brelse(map.bh);
+
+	return *files ? 0 : -ENOMEM;
+}
+
+/*
+ * Return 1 if dir has no entry, 0 if it has some.
+ */
+int ouichefs_dir_is_empty(struct inode *dir)
+{
+	struct ouichefs_dir_map map;
+	struct buffer_head *bh;
+	int ret;
+
+	if (ouichefs_is_indexed(dir)) {
+		bh = sb_bread(dir->i_sb, OUICHEFS_INODE(dir)->index_block);
+		if (!bh)
+			return -EIO;
+		ret = !((struct ouichefs_dx_node *)bh->b_data)->nr_files;
+		brelse(bh);
+		return ret;
+	}
+
+	ret = ouichefs_map_dir(dir, &map);
+	if (ret)
+		return ret;
+	ret = !map.nr_slots || !map.files[0].inode;
+	brelse(map.bh);
+
+	return ret;
+}
+
+/*
+ * Iterate over the files contained in dir and commit them in ctx.
+ * This function is called by the VFS while ctx->pos changes.
+ * Return 0 on success.
+ */
+static int ouichefs_iterate(struct file *dir, struct dir_context *ctx)
+{
+	struct inode *inode = file_inode(dir);
+	struct ouichefs_dir_map map;
+	struct ouichefs_file *f;
+	uint32_t i;
+	int ret;
+
+	/* Check that dir is a directory */
+	if (!S_ISDIR(inode->i_mode))
+		return -ENOTDIR;
+
+	/* Commit . and .. to ctx */
+	if (!dir_emit_dots(dir, ctx))
+		return 0;
+
+	if (ouichefs_is_indexed(inode))
+		return ouichefs_dx_iterate(inode, ctx);
+
+	/* Read the directory entries on disk */
+	ret = ouichefs_map_dir(inode, &map);
+	if (ret)
+		return ret;
+
+	/* Once per directory, later calls resume the same listing */
+	if (ctx->pos == 2)
+		ouichefs_readahead_children(inode->i_sb, map.files,
+					    map.nr_slots);
+
+	/* Iterate over the entries and commit subfiles */
+	for (i = ctx->pos - 2; i < map.nr_slots; i++) {
+		f = &map.files[i];
+		if (!f->inode)
+			break;
+		if (!dir_emit(ctx, f->filename,
+			      strnlen(f->filename, OUICHEFS_FILENAME_LEN),
+			      le32_to_cpu(f->inode), DT_UNKNOWN))
+			break;
+		ctx->pos++;
+	}
+
+	brelse(map.bh);
+
+	return 0;
+}
+
+/*
+ * Report the usage of the subtree of the directory, see struct ouichefs_usage,
+ * or remove everything below it. FITRIM is taken here as fstrim(8) issues it
+ * on the mount point.
+ */
+static long ouichefs_dir_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct inode *dir = file_inode(file);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	struct ouichefs_usage u;
+	int ret;
+
+	if (cmd == FITRIM)
+		return ouichefs_trim_fs(dir->i_sb, (void __user *)arg);
+	if (cmd == OUICHEFS_IOCTL_RMTREE)
+		return ouichefs_rmtree(file);
+	if (cmd != OUICHEFS_IOCTL_DIR_USAGE)
+		return -ENOTTY;
+	if (!(sbi->s_features & OUICHEFS_FEATURE_DIR_USAGE))
+		return -EOPNOTSUPP;
+
+	ret = ouichefs_usage_subtree(dir, &u);
+	if (ret)
+		return ret;
+	if (copy_to_user((void __user *)arg, &u, sizeof(u)))
+		return -EFAULT;
+
+	return 0;
+}
+
+const struct file_operations ouichefs_dir_ops = {
+	.owner = THIS_MODULE,
+	.iterate_shared = ouichefs_iterate,
+	.unlocked_ioctl = ouichefs_dir_ioctl,
+};
@@ -11,11 +11,18 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/namei.h>
+#include <linux/sched/signal.h>
+#include <linux/mount.h>
+#include <linux/fsnotify.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 
 static const struct inode_operations ouichefs_inode_ops;
+static const struct inode_operations ouichefs_symlink_inode_ops;
 
 /*
  * Get inode ino from disk.
@@ -27,8 +34,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	struct ouichefs_inode_info *ci = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK(sb)) + 1;
 	int ret;
 
 	/* Fail if ino is out of range */
@@ -50,8 +56,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 		ret = -EIO;
 		goto failed;
 	}
-	cinode = (struct ouichefs_inode *)bh->b_data;
-	cinode += inode_shift;
+	cinode = ouichefs_disk_inode(sb, bh, ino);
 
 	inode->i_ino = ino;
 	inode->i_sb = sb;
@@ -70,13 +75,28 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	inode->i_blocks = le32_to_cpu(cinode->i_blocks);
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
-	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->index_block = ouichefs_get_disk_index(sbi, cinode);
+	ci->i_flags = le32_to_cpu(cinode->i_flags);
+	ci->i_slice_hint = 0;
+	memset(ci->i_data, 0, sizeof(ci->i_data));
+	memcpy(ci->i_data, cinode->i_data, sbi->inline_size);
+	memset(&ci->i_usage, 0, sizeof(ci->i_usage));
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
+		if (sbi->s_features & OUICHEFS_FEATURE_DIR_USAGE) {
+			struct ouichefs_disk_usage *du = (void *)cinode->i_data;
+
+			ci->i_usage.bytes = le64_to_cpu(du->bytes);
+			ci->i_usage.slices = le64_to_cpu(du->slices);
+			ci->i_usage.blocks = le64_to_cpu(du->blocks);
+			ci->i_usage.files = le64_to_cpu(du->files);
+		}
 	} else if (S_ISREG(inode->i_mode)) {
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+	} else if (S_ISLNK(inode->i_mode)) {
+		inode->i_op = &ouichefs_symlink_inode_ops;
 	}
 
 	brelse(bh);
@@ -101,40 +121,61 @@ static struct dentry *ouichefs_lookup(struct inode *dir, struct dentry *dentry,
 				      unsigned int flags)
 {
 	struct super_block *sb = dir->i_sb;
-	struct ouichefs_inode_info *ci_dir = OUICHEFS_INODE(dir);
 	struct inode *inode = NULL;
-	struct buffer_head *bh = NULL;
-	struct ouichefs_dir_block *dblock = NULL;
-	struct ouichefs_file *f = NULL;
-	int i;
+	uint32_t ino;
+	int ret;
 
 	/* Check filename length */
 	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	/* Read the directory index block on disk */
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return ERR_PTR(-EIO);
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
 	/* Search for the file in directory */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		f = &dblock->files[i];
-		if (!f->inode)
-			break;
-		if (!strncmp(f->filename, dentry->d_name.name,
-			     OUICHEFS_FILENAME_LEN)) {
-			inode = ouichefs_iget(sb, le32_to_cpu(f->inode));
-			break;
-		}
-	}
-	brelse(bh);
+	ret = ouichefs_find_entry(dir, &dentry->d_name, &ino);
+	if (!ret)
+		inode = ouichefs_iget(sb, ino);
+	else if (ret != -ENOENT)
+		return ERR_PTR(ret);
 
 	/* Fill the dentry with the inode */
-	d_add(dentry, inode);
+	return d_splice_alias(inode, dentry);
+}
+
+/* Number of inode bitmap blocks looked at for an empty inode store block */
+#define OUICHEFS_DIR_SPREAD 4
 
-	return NULL;
+/*
+ * Pick the inode number of a new inode in dir. Files and symlinks go close
+ * to dir, in its inode store block if it has room, so that reading a
+ * directory reads a few dense inode store blocks. New directories start an
+ * unused inode store block of their own, rotating over the inode bitmap
+ * blocks, to leave room next to them for their own entries.
+ */
+static uint32_t ouichefs_pick_ino(struct inode *dir, mode_t mode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+	uint32_t idx, rotor, i, ino = 0;
+
+	if (S_ISDIR(mode)) {
+		rotor = READ_ONCE(sbi->dir_rotor);
+		for (i = 0; !ino && i < min_t(uint32_t, OUICHEFS_DIR_SPREAD,
+						sbi->ifree.nr_blocks); i++) {
+			idx = (rotor + i) % sbi->ifree.nr_blocks;
+			ino = get_free_inode_block(sbi, idx);
+		}
+		if (ino)
+			WRITE_ONCE(sbi->dir_rotor,
+				   (idx + 1) % sbi->ifree.nr_blocks);
+	} else {
+		ino = get_free_inode_near(sbi, dir->i_ino);
+	}
+
+	/*
+	 * Anywhere will do, from the cache of this CPU. Under contention on the
+	 * bitmap, that is where inodes go rather than next to dir.
+	 */
+	if (!ino)
+		ino = get_free_inode(sbi);
+	return ino;
 }
 
 /*
@@ -150,19 +191,19 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	int ret;
 
 	/* Check mode before doing anything to avoid undoing everything */
-	if (!S_ISDIR(mode) && !S_ISREG(mode)) {
-		pr_err("File type not supported (only directory and regular files supported)\n");
+	if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
+		pr_err("File type not supported (only directory, regular files and symlinks supported)\n");
 		return ERR_PTR(-EINVAL);
 	}
 
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (!has_free_inodes(sbi, 1) || !has_free_blocks(sbi, 1))
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
-	ino = get_free_inode(sbi);
+	ino = ouichefs_pick_ino(dir, mode);
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
 	inode = ouichefs_iget(sb, ino);
@@ -174,6 +215,10 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 
 	/* Get a free block for this new inode's index */
 	ci->index_block = 0;
+	ci->i_flags = 0;
+	ci->i_slice_hint = 0;
+	memset(&ci->i_usage, 0, sizeof(ci->i_usage));
+	memset(ci->i_data, 0, sizeof(ci->i_data));
 
 	inode->i_blocks = 1;
 
@@ -181,12 +226,16 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
 	inode->i_blocks = 1;
 	if (S_ISDIR(mode)) {
-		inode->i_size = OUICHEFS_BLOCK_SIZE;
+		/* Empty directories own no storage */
+		inode->i_size = 0;
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(mode)) {
 		inode->i_size = 0;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+	} else if (S_ISLNK(mode)) {
+		inode->i_size = 0;
+		inode->i_op = &ouichefs_symlink_inode_ops;
 	}
 	set_nlink(inode, 1);
 
@@ -200,72 +249,217 @@ put_ino:
 	return ERR_PTR(ret);
 }
 
+/*
+ * Usage of directories. Each directory accounts for its own storage and for
+ * the storage of its entries, subdirectories counting as a file only, so a
+ * change is charged to the parent of the inode that changed alone. The usage
+ * of a subtree is summed over its directories when asked, see
+ * ouichefs_usage_subtree().
+ */
+
+/* Storage used by inode itself, not what is below it */
+void ouichefs_usage_own(struct inode *inode, struct ouichefs_usage *u)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+
+	memset(u, 0, sizeof(*u));
+	if (!S_ISDIR(inode->i_mode))
+		u->bytes = inode->i_size;
+	if (ouichefs_is_sliced(inode))
+		u->slices = max_t(uint32_t, 1,
+			DIV_ROUND_UP(inode->i_size, sbi->s_slice_size));
+	else if (ouichefs_is_indexed(inode))
+		u->blocks = inode->i_size / inode->i_sb->s_blocksize;
+	else if (S_ISDIR(inode->i_mode) && ci->index_block)
+		u->blocks = 1;
+	else if (ci->index_block)
+		u->blocks = inode->i_blocks;
+}
+
+void ouichefs_usage_read(struct inode *dir, struct ouichefs_usage *u)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+
+	spin_lock(&sbi->usage_lock);
+	*u = OUICHEFS_INODE(dir)->i_usage;
+	spin_unlock(&sbi->usage_lock);
+}
+
+/*
+ * What the parent of inode accounts for it, the inode counted as a file. A
+ * directory keeps its own storage to itself.
+ */
+static void ouichefs_usage_total(struct inode *inode, struct ouichefs_usage *u)
+{
+	if (S_ISDIR(inode->i_mode))
+		memset(u, 0, sizeof(*u));
+	else
+		ouichefs_usage_own(inode, u);
+	u->files++;
+}
+
+/*
+ * Add delta, or subtract it if sub, to the directory of dentry. Its ancestors
+ * are left alone, so that concurrent changes in different directories only
+ * meet on usage_lock for a few additions.
+ */
+static void ouichefs_usage_charge(struct dentry *dentry,
+				  const struct ouichefs_usage *delta, bool sub)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(dentry->d_sb);
+	struct ouichefs_usage d = *delta;
+	struct ouichefs_inode_info *ci;
+	struct inode *dir = d_inode(dentry);
+
+	if (!(sbi->s_features & OUICHEFS_FEATURE_DIR_USAGE))
+		return;
+	if (!d.bytes && !d.slices && !d.blocks && !d.files)
+		return;
+	if (sub) {
+		d.bytes = -d.bytes;
+		d.slices = -d.slices;
+		d.blocks = -d.blocks;
+		d.files = -d.files;
+	}
+
+	ci = OUICHEFS_INODE(dir);
+	spin_lock(&sbi->usage_lock);
+	ci->i_usage.bytes += d.bytes;
+	ci->i_usage.slices += d.slices;
+	ci->i_usage.blocks += d.blocks;
+	ci->i_usage.files += d.files;
+	spin_unlock(&sbi->usage_lock);
+	mark_inode_dirty(dir);
+}
+
+/*
+ * Storage used below dir, dir included: the sum of what dir and all the
+ * directories below it account for, walked depth first. Directories are read
+ * one at a time, the sum may mix states of the subtree changed meanwhile.
+ */
+int ouichefs_usage_subtree(struct inode *dir, struct ouichefs_usage *u)
+{
+	struct super_block *sb = dir->i_sb;
+	struct inode **stack = NULL, **tmp, *inode, *child;
+	struct ouichefs_file *files;
+	struct ouichefs_usage d;
+	uint32_t depth = 0, size = 0, nr, i, subdirs;
+	int ret = 0;
+
+	memset(u, 0, sizeof(*u));
+	inode = igrab(dir);
+	while (inode) {
+		ouichefs_usage_read(inode, &d);
+		u->bytes += d.bytes;
+		u->slices += d.slices;
+		u->blocks += d.blocks;
+		u->files += d.files;
+
+		/* Only directories holding subdirectories are worth reading */
+		files = NULL;
+		inode_lock_shared(inode);
+		subdirs = inode->i_nlink > 2 ? inode->i_nlink - 2 : 0;
+		if (subdirs && !IS_DEADDIR(inode))
+			ret = ouichefs_dir_entries(inode, &files, &nr);
+		else
+			subdirs = 0;
+		inode_unlock_shared(inode);
+		iput(inode);
+		if (ret)
+			break;
+
+		for (i = 0; subdirs && i < nr; i++) {
+			child = ouichefs_iget(sb, le32_to_cpu(files[i].inode));
+			if (IS_ERR(child))
+				continue;
+			if (!S_ISDIR(child->i_mode)) {
+				iput(child);
+				continue;
+			}
+			if (depth == size) {
+				tmp = krealloc_array(stack, size + 64,
+						     sizeof(*stack), GFP_KERNEL);
+				if (!tmp) {
+					iput(child);
+					ret = -ENOMEM;
+					break;
+				}
+				stack = tmp;
+				size += 64;
+			}
+			stack[depth++] = child;
+			subdirs--;
+		}
+		kvfree(files);
+		if (ret)
+			break;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+		inode = depth ? stack[--depth] : NULL;
+	}
+	while (depth)
+		iput(stack[--depth]);
+	kfree(stack);
+
+	return ret;
+}
+
+/*
+ * Charge the change of the own storage of inode since before to the directory
+ * of dentry and its ancestors: the parent of inode, or inode itself when it
+ * is a directory whose entries changed.
+ */
+void ouichefs_usage_update(struct dentry *dentry, struct inode *inode,
+			   const struct ouichefs_usage *before)
+{
+	struct ouichefs_usage u;
+
+	/* Temporary files are charged when they get linked */
+	if (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_ORPHAN)
+		return;
+	ouichefs_usage_own(inode, &u);
+	u.bytes -= before->bytes;
+	u.slices -= before->slices;
+	u.blocks -= before->blocks;
+	u.files -= before->files;
+	ouichefs_usage_charge(dentry, &u, false);
+}
+
 /*
  * Create a file or directory in this way:
- *   - check filename length and if the parent directory is not full
- *   - create the new inode (allocate inode and blocks)
- *   - cleanup index block of the new inode
- *   - add new file/directory in parent index
+ *   - check filename length
+ *   - create the new inode (files and directories start without any block)
+ *   - add new file/directory in parent directory, growing it if needed
  */
-static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
-			   struct dentry *dentry, umode_t mode, bool excl)
+static int __ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
+			     struct dentry *dentry, umode_t mode, bool excl)
 {
-	struct super_block *sb;
+	struct ouichefs_usage before, u;
 	struct inode *inode;
-	struct ouichefs_inode_info *ci_dir;
-	struct ouichefs_dir_block *dblock;
-	char *fblock;
-	struct buffer_head *bh, *bh2;
-	int ret = 0, i;
+	int ret;
 
 	/* Check filename length */
-	if (strlen(dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Read parent directory index */
-	ci_dir = OUICHEFS_INODE(dir);
-	sb = dir->i_sb;
-	bh = sb_bread(sb, ci_dir->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Check if parent directory is full */
-	if (dblock->files[OUICHEFS_MAX_SUBFILES - 1].inode != 0) {
-		ret = -EMLINK;
-		goto end;
-	}
-
 	/* Get a new free inode */
 	inode = ouichefs_new_inode(dir, mode);
-	if (IS_ERR(inode)) {
-		ret = PTR_ERR(inode);
-		goto end;
-	}
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
 
-	/*
-	 * Scrub index_block for new file/directory to avoid previous data
-	 * messing with new file/directory.
-	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh2) {
-		ret = -EIO;
+	/* Register new inode in parent directory */
+	ouichefs_usage_own(dir, &before);
+	ret = ouichefs_add_entry(dir, &dentry->d_name, inode->i_ino);
+	if (ret)
 		goto iput;
-	}
-	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
-	brelse(bh2);
-
-	/* Find first free slot in parent index and register new inode */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
-		if (dblock->files[i].inode == 0)
-			break;
-	dblock->files[i].inode = cpu_to_le32(inode->i_ino);
-	strscpy(dblock->files[i].filename, dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh);
-	brelse(bh);
+	ouichefs_usage_update(dentry->d_parent, dir, &before);
+	ouichefs_usage_total(inode, &u);
+	ouichefs_usage_charge(dentry->d_parent, &u, false);
 
 	/* Update stats and mark dir and new inode dirty */
 	mark_inode_dirty(inode);
@@ -286,17 +480,33 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	return 0;
 
 iput:
-	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
-	put_inode(OUICHEFS_SB(sb), inode->i_ino);
+	put_inode(OUICHEFS_SB(dir->i_sb), inode->i_ino);
+	clear_nlink(inode);
 	iput(inode);
-end:
-	brelse(bh);
+	return ret;
+}
+
+/* Each directory operation is a single journal transaction */
+static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
+			   struct dentry *dentry, umode_t mode, bool excl)
+{
+	int ret, retries = 0;
+	bool h;
+
+	/* Blocks freed by the running transaction are back once committed */
+	do {
+		h = ouichefs_journal_start(dir->i_sb);
+		ret = __ouichefs_create(idmap, dir, dentry, mode, excl);
+		ouichefs_journal_stop(dir->i_sb, h);
+	} while (ret == -ENOSPC &&
+		 ouichefs_journal_retry_alloc(dir->i_sb, &retries));
 	return ret;
 }
 
 /**
  *	task 1.7 Frees a slice used by a small file, and updates block state
  *	task 1.10 updated for multi slice
+ *	slice state now lives in the slice map, all slices carry data
 **/
 void release_slice(struct inode *inode)
 {
@@ -304,65 +514,15 @@ void release_slice(struct inode *inode)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 
-	uint32_t raw = ci->index_block;
-	uint32_t slice_no = raw >> 27;
-	uint32_t block_no = raw & ((1 << 27) - 1);
-	uint32_t num_slices = DIV_ROUND_UP(inode->i_size, 128);
-
-	struct buffer_head *bh = sb_bread(sb, block_no);
-	if (!bh)
-		return;
-
-	struct ouichefs_sliced_block_meta *meta = (struct ouichefs_sliced_block_meta *)bh->b_data;
-	uint32_t bitmap = le32_to_cpu(meta->slice_bitmap);
-
-	// Free all slices used
-	bitmap |= ((1 << num_slices) - 1) << slice_no;
-	meta->slice_bitmap = cpu_to_le32(bitmap);
-	/* update super block data */
-	sbi->total_free_slices += num_slices;
-
-	// Check if block became fully free
-	if (bitmap == 0xFFFFFFFF) {
-		/* update super block data */
-		sbi->sliced_blocks--;
-		sbi->total_used_size -= OUICHEFS_BLOCK_SIZE;
-		sbi->total_free_slices -= 32;
-		// Remove from partial list if necessary
-		uint32_t curr = sbi->s_free_sliced_blocks;
-		uint32_t prev = 0;
-
-		while (curr) {
-			struct buffer_head *bh_curr = sb_bread(sb, curr);
-			if (!bh_curr) break;
-
-			struct ouichefs_sliced_block_meta *meta_curr = (void *)bh_curr->b_data;
-			if (curr == block_no) {
-				if (prev)
-					((struct ouichefs_sliced_block_meta *)sb_bread(sb, prev)->b_data)->next_partial_block = meta_curr->next_partial_block;
-				else
-					sbi->s_free_sliced_blocks = le32_to_cpu(meta_curr->next_partial_block);
-				brelse(bh_curr);
-				break;
-			}
-
-			prev = curr;
-			curr = le32_to_cpu(meta_curr->next_partial_block);
-			brelse(bh_curr);
-		}
+	uint64_t raw = ci->index_block;
+	uint32_t num_slices = max_t(uint32_t, 1,
+		DIV_ROUND_UP(inode->i_size, sbi->s_slice_size));
 
-		put_block(sbi, block_no);
-	} else {
-		// Add back to partial list if not already
-		meta->next_partial_block = cpu_to_le32(sbi->s_free_sliced_blocks);
-		sbi->s_free_sliced_blocks = block_no;
-
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-	}
+	ouichefs_free_slices(sb, extract_block_num(raw), extract_slice_num(raw),
+			     num_slices);
 
-	brelse(bh);
 	ci->index_block = 0;
+	ci->i_flags &= ~OUICHEFS_INODE_SLICED;
 	inode->i_blocks = 0;
 	inode->i_size = 0;
 	mark_inode_dirty(inode);
@@ -375,103 +535,236 @@ void release_slice(struct inode *inode)
  *   - cleanup file index block
  *   - cleanup inode
  */
+static int __ouichefs_unlink(struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ouichefs_usage before, u;
+	int ret;
+
+	/* Remove file from parent directory */
+	ouichefs_usage_own(dir, &before);
+	ret = ouichefs_remove_entry(dir, &dentry->d_name);
+	if (ret)
+		return ret;
+	ouichefs_usage_update(dentry->d_parent, dir, &before);
+	ouichefs_usage_total(inode, &u);
+	ouichefs_usage_charge(dentry->d_parent, &u, true);
+
+	/* Update inode stats */
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	if (S_ISDIR(inode->i_mode))
+		inode_dec_link_count(dir);
+	mark_inode_dirty(dir);
+
+	ouichefs_free_inode(inode);
+
+	return 0;
+}
+
 static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
+	bool h = ouichefs_journal_start(dir->i_sb);
+	int ret;
+
+	ret = __ouichefs_unlink(dir, dentry);
+	ouichefs_journal_stop(dir->i_sb, h);
+	return ret;
+}
+
+/* A file index block whose blocks are waiting for the reclaim worker */
+struct ouichefs_reclaim {
+	struct list_head list;
+	struct super_block *sb;
+	uint32_t index_block;
+};
+
+/*
+ * Put the data blocks listed in a file index block, then the index block
+ * itself. If the index block cannot be read, its data blocks are lost. With
+ * the discard mount option, the blocks are collected and discarded first.
+ */
+static void ouichefs_reclaim_index(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh;
+	uint32_t *blocks = NULL;
+	int i, nr = 0;
+
+	if (sbi->s_mount_opt & OUICHEFS_MOUNT_DISCARD)
+		blocks = kmalloc_array(OUICHEFS_INDEX_ENTRIES(sb) + 1,
+				       sizeof(uint32_t), GFP_NOFS);
+
+	bh = sb_bread(sb, bno);
+	if (bh) {
+		index = (struct ouichefs_file_index_block *)bh->b_data;
+		for (i = 0; i < OUICHEFS_INDEX_ENTRIES(sb); i++) {
+			if (!index->blocks[i])
+				continue;
+			if (blocks)
+				blocks[nr++] = le32_to_cpu(index->blocks[i]);
+			else
+				put_block(sbi, le32_to_cpu(index->blocks[i]));
+		}
+		/* Nothing to write back, the block is free from now on */
+		bforget(bh);
+	}
+
+	if (blocks) {
+		blocks[nr++] = bno;
+		ouichefs_discard_blocks(sb, blocks, nr);
+		kfree(blocks);
+	} else {
+		put_block(sbi, bno);
+	}
+}
+
+/*
+ * Reclaim the oldest queued index block, return false if there is none left.
+ * With a journal, its blocks are freed in the running transaction, which is
+ * the one of the unlink that queued it since commits reclaim whatever is left
+ * first. Rather than waiting for a commit, leave the rest to it.
+ */
+static bool ouichefs_reclaim_one(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_journal *j = sbi->journal;
+	struct ouichefs_reclaim *r;
+	bool h = false;
+
+	if (j && current->journal_info != j) {
+		if (!ouichefs_journal_trystart(j->sb))
+			return false;
+		h = true;
+	}
+
+	spin_lock(&sbi->reclaim_lock);
+	r = list_first_entry_or_null(&sbi->reclaim_list, struct ouichefs_reclaim,
+				     list);
+	if (r)
+		list_del(&r->list);
+	spin_unlock(&sbi->reclaim_lock);
+	if (r) {
+		ouichefs_reclaim_index(r->sb, r->index_block);
+		kfree(r);
+	}
+
+	if (h)
+		ouichefs_journal_stop(j->sb, h);
+	return r;
+}
+
+/* Reclaim all the queued index blocks, from the commit of a transaction */
+void ouichefs_reclaim_pending(struct ouichefs_sb_info *sbi)
+{
+	while (ouichefs_reclaim_one(sbi))
+		;
+}
+
+/*
+ * Reclaim worker: free the blocks of all the queued index blocks. Index
+ * blocks are read ahead in one batch before being walked.
+ */
+void ouichefs_reclaim_work(struct work_struct *work)
+{
+	struct ouichefs_sb_info *sbi = container_of(work, struct ouichefs_sb_info,
+						    reclaim_work);
+	struct ouichefs_reclaim *r;
+	struct blk_plug plug;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->reclaim_lock);
+	list_splice_init(&sbi->reclaim_list, &list);
+	spin_unlock(&sbi->reclaim_lock);
+
+	blk_start_plug(&plug);
+	list_for_each_entry(r, &list, list)
+		sb_breadahead(r->sb, r->index_block);
+	blk_finish_plug(&plug);
+
+	/* Back in front of those queued meanwhile, in order */
+	spin_lock(&sbi->reclaim_lock);
+	list_splice(&list, &sbi->reclaim_list);
+	spin_unlock(&sbi->reclaim_lock);
+
+	while (ouichefs_reclaim_one(sbi))
+		cond_resched();
+}
+
+/*
+ * Hand the blocks of a file over to the reclaim worker. If we cannot
+ * allocate the request, reclaim them right away.
+ */
+static void ouichefs_queue_reclaim(struct super_block *sb, uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_reclaim *r;
+
+	r = kmalloc(sizeof(*r), GFP_NOFS);
+	if (!r) {
+		ouichefs_reclaim_index(sb, bno);
+		return;
+	}
+	r->sb = sb;
+	r->index_block = bno;
+
+	spin_lock(&sbi->reclaim_lock);
+	list_add_tail(&r->list, &sbi->reclaim_list);
+	spin_unlock(&sbi->reclaim_lock);
+	queue_work(sbi->wq, &sbi->reclaim_work);
+}
+
+/*
+ * Free inode and its storage once its last name is gone, from unlink, rmdir
+ * or rename over it, or when an unlinked O_TMPFILE inode is evicted.
+ */
+void ouichefs_free_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
-	int i, f_id = -1, nr_subs = 0;
 
 	loff_t old_size = inode->i_size;
 
 	ino = inode->i_ino;
 	bno = OUICHEFS_INODE(inode)->index_block;
 
-	/* Read parent directory index */
-	bh = sb_bread(sb, OUICHEFS_INODE(dir)->index_block);
-	if (!bh)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh->b_data;
-
-	/* Search for inode in parent index and get number of subfiles */
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		if (le32_to_cpu(dir_block->files[i].inode) == ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
-	}
-	nr_subs = i;
-
-	/* Remove file from parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh);
-	brelse(bh);
-
 	/* update super block data here */
 	if (S_ISREG(inode->i_mode)) {
 		sbi->files--;
 		sbi->total_data_size -= old_size;
 		/* check including empty small file */
-		if (old_size <= 128) {
+		if (old_size <= sbi->s_slice_size) {
 			sbi->small_files--;
 		}
 	}
 
+	/* Directories free their storage whatever its layout */
+	if (S_ISDIR(inode->i_mode)) {
+		ouichefs_release_dir(inode);
+		bno = 0;
+		goto clean_inode;
+	}
 
 	// task 1.7 detect small file
-	if (old_size <= 128 && OUICHEFS_INODE(inode)->index_block != 0) {
+	if (ouichefs_is_sliced(inode)) {
 		release_slice(inode);
+		bno = 0;
 		goto clean_inode;
 	}
 
-	/* Update inode stats */
-	dir->i_mtime = dir->i_ctime = current_time(dir);
-	if (S_ISDIR(inode->i_mode))
-		inode_dec_link_count(dir);
-	mark_inode_dirty(dir);
+	/* Files that never got a block have nothing else to cleanup */
+	if (!bno)
+		goto clean_inode;
 
 	/*
-	 * Cleanup pointed blocks if unlinking a file. If we fail to read the
-	 * index block, cleanup inode anyway and lose this file's blocks
-	 * forever. If we fail to scrub a data block, don't fail (too late
-	 * anyway), just put the block and continue.
+	 * Blocks of the file go back to the bitmap from the reclaim worker so
+	 * that unlink does not depend on the file size. No page of the file
+	 * must be written back to them once they are reused.
 	 */
-	bh = sb_bread(sb, bno);
-	if (!bh)
-		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		bh2 = sb_bread(sb, le32_to_cpu(file_block->blocks[i]));
-		if (!bh2)
-			goto put_block;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-put_block:
-		put_block(sbi, le32_to_cpu(file_block->blocks[i]));
-	}
-
-scrub:
-	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	truncate_inode_pages(inode->i_mapping, 0);
+	ouichefs_queue_reclaim(sb, bno);
+	/* The index block goes with its data blocks */
+	bno = 0;
 
 clean_inode:
 	/* update super block state */
@@ -482,127 +775,562 @@ clean_inode:
 	/* Cleanup inode and mark dirty */
 	inode->i_blocks = 0;
 	OUICHEFS_INODE(inode)->index_block = 0;
+	OUICHEFS_INODE(inode)->i_flags = 0;
+	memset(OUICHEFS_INODE(inode)->i_data, 0,
+	       sizeof(OUICHEFS_INODE(inode)->i_data));
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
 	inode->i_mode = 0;
 	inode->i_ctime.tv_sec = inode->i_mtime.tv_sec = inode->i_atime.tv_sec = 0;
 	inode->i_ctime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_atime.tv_nsec = 0;
-	inode_dec_link_count(inode);
+	if (inode->i_nlink)
+		inode_dec_link_count(inode);
 	mark_inode_dirty(inode);
 
 	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
+	if (bno)
+		put_block(sbi, bno);
 	put_inode(sbi, ino);
 	clear_nlink(inode);
 	mark_inode_dirty(inode);
+}
+
+/*
+ * Batched removal of a subtree, see OUICHEFS_IOCTL_RMTREE. Directories are
+ * handled one at a time, deepest first: once all the subdirectories of a
+ * directory are empty, its entries are removed in batches. The slices of a
+ * batch are given back block by block, and the storage of the directory is
+ * released at once with the last batch instead of removing entries one by one.
+ */
+struct ouichefs_rmtree_node {
+	struct list_head list;
+	struct dentry *dentry;
+	bool expanded; /* Non-empty subdirectories are queued above */
+};
+
+static int ouichefs_rmtree_push(struct list_head *stack, struct dentry *dentry)
+{
+	struct ouichefs_rmtree_node *node;
+
+	node = kmalloc(sizeof(*node), GFP_KERNEL);
+	if (!node) {
+		dput(dentry);
+		return -ENOMEM;
+	}
+	node->dentry = dentry;
+	node->expanded = false;
+	list_add(&node->list, stack);
 
 	return 0;
 }
 
-static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
-			   struct dentry *old_dentry, struct inode *new_dir,
-			   struct dentry *new_dentry, unsigned int flags)
+static void ouichefs_rmtree_pop(struct ouichefs_rmtree_node *node)
+{
+	list_del(&node->list);
+	dput(node->dentry);
+	kfree(node);
+}
+
+static struct dentry *ouichefs_rmtree_lookup(struct dentry *parent,
+					     struct ouichefs_file *f)
+{
+	return lookup_one_len(f->filename, parent,
+			      strnlen(f->filename, OUICHEFS_FILENAME_LEN));
+}
+
+/* Queue the non-empty subdirectories of the directory of node */
+static int ouichefs_rmtree_expand(struct list_head *stack,
+				  struct ouichefs_rmtree_node *node,
+				  struct ouichefs_file *files, uint32_t nr)
+{
+	struct dentry *child;
+	uint32_t i;
+	int ret = 0;
+
+	node->expanded = true;
+	for (i = 0; !ret && i < nr; i++) {
+		child = ouichefs_rmtree_lookup(node->dentry, &files[i]);
+		if (IS_ERR(child))
+			return PTR_ERR(child);
+		if (d_is_dir(child) && ouichefs_dir_is_empty(d_inode(child)) == 0)
+			ret = ouichefs_rmtree_push(stack, child);
+		else
+			dput(child);
+	}
+
+	return ret;
+}
+
+/*
+ * Children removed per transaction. A batch logs their inodes, dir, the inode
+ * bitmap blocks and, unless it is the last, a hashed leaf per entry: it fits
+ * in the room an operation reserves.
+ */
+#define OUICHEFS_RMTREE_BATCH 6
+
+/*
+ * Lock and check the children of dir from files[*i] on, up to a batch of them.
+ * Entries that cannot be removed (a subdirectory filled meanwhile, a mount
+ * point) are counted in kept. The first child is waited for, the others only
+ * join the batch if their lock is free: no two of them are waited for at once.
+ */
+static int ouichefs_rmtree_batch(struct dentry *dentry,
+				 struct ouichefs_file *files, uint32_t nr,
+				 uint32_t *i, struct dentry **batch,
+				 uint32_t *kept)
+{
+	struct dentry *child;
+	struct inode *inode;
+	int n = 0;
+
+	while (*i < nr && n < OUICHEFS_RMTREE_BATCH) {
+		child = ouichefs_rmtree_lookup(dentry, &files[*i]);
+		if (IS_ERR(child))
+			return n ? n : PTR_ERR(child);
+		inode = d_inode(child);
+		if (!inode || d_mountpoint(child)) {
+			(*kept)++;
+			(*i)++;
+			dput(child);
+			continue;
+		}
+
+		if (!n) {
+			inode_lock_nested(inode, I_MUTEX_CHILD);
+		} else if (!inode_trylock(inode)) {
+			dput(child);
+			break;
+		}
+		(*i)++;
+		if (S_ISDIR(inode->i_mode) && ouichefs_dir_is_empty(inode) != 1) {
+			inode_unlock(inode);
+			(*kept)++;
+			dput(child);
+			continue;
+		}
+		batch[n++] = child;
+	}
+
+	return n;
+}
+
+/*
+ * Remove all the entries of dir, whose subdirectories are empty, a batch per
+ * transaction. Each batch frees the inodes of its children, then their slices
+ * together. Entries of the last batch go with the storage of dir, those of the
+ * others are removed one by one, so that no entry outlives its inode.
+ */
+static int ouichefs_rmtree_empty(struct dentry *dentry,
+				 struct ouichefs_file *files, uint32_t nr)
+{
+	struct inode *dir = d_inode(dentry);
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_slice_run runs[OUICHEFS_RMTREE_BATCH];
+	struct dentry *batch[OUICHEFS_RMTREE_BATCH];
+	struct ouichefs_usage before, removed, u;
+	struct ouichefs_inode_info *ci;
+	struct inode *inode;
+	uint32_t i = 0, kept = 0, nr_runs;
+	int n, done, k, ret = 0;
+	bool h, last;
+
+	while (i < nr) {
+		n = ouichefs_rmtree_batch(dentry, files, nr, &i, batch, &kept);
+		if (n <= 0) {
+			ret = n;
+			break;
+		}
+		last = i == nr && !kept;
+
+		/* Never wait for an inode lock inside a transaction */
+		h = ouichefs_journal_start(sb);
+		ouichefs_usage_own(dir, &before);
+		memset(&removed, 0, sizeof(removed));
+		nr_runs = 0;
+		for (k = 0; k < n; k++) {
+			inode = d_inode(batch[k]);
+			if (!last) {
+				ret = ouichefs_remove_entry(dir,
+							    &batch[k]->d_name);
+				if (ret)
+					break;
+			}
+			ouichefs_usage_total(inode, &u);
+			removed.bytes += u.bytes;
+			removed.slices += u.slices;
+			removed.blocks += u.blocks;
+			removed.files += u.files;
+
+			/* Slices of files are given back together below */
+			ci = OUICHEFS_INODE(inode);
+			if (!S_ISDIR(inode->i_mode) && ouichefs_is_sliced(inode)) {
+				runs[nr_runs].block =
+					extract_block_num(ci->index_block);
+				runs[nr_runs].nr = max_t(uint32_t, 1,
+					DIV_ROUND_UP(inode->i_size,
+						     sbi->s_slice_size));
+				runs[nr_runs].mask = GENMASK_ULL(
+					extract_slice_num(ci->index_block) +
+					runs[nr_runs].nr - 1,
+					extract_slice_num(ci->index_block));
+				nr_runs++;
+				ci->index_block = 0;
+				ci->i_flags &= ~OUICHEFS_INODE_SLICED;
+			}
+			if (S_ISDIR(inode->i_mode)) {
+				inode->i_flags |= S_DEAD;
+				dont_mount(batch[k]);
+				drop_nlink(dir);
+			}
+			ouichefs_free_inode(inode);
+		}
+		done = k;
+		ouichefs_free_slice_runs(sb, runs, nr_runs);
+
+		/* All the entries are gone with this batch, drop dir at once */
+		if (last)
+			ouichefs_release_dir(dir);
+		ouichefs_usage_update(dentry, dir, &before);
+		ouichefs_usage_charge(dentry, &removed, true);
+		dir->i_mtime = dir->i_ctime = current_time(dir);
+		mark_inode_dirty(dir);
+		ouichefs_journal_stop(sb, h);
+
+		for (k = 0; k < n; k++) {
+			inode = d_inode(batch[k]);
+			inode_unlock(inode);
+			if (k < done) {
+				if (!S_ISDIR(inode->i_mode))
+					fsnotify_link_count(inode);
+				d_delete_notify(dir, batch[k]);
+			}
+			dput(batch[k]);
+		}
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+static int ouichefs_rmtree_dir(struct file *file, struct list_head *stack,
+			       struct ouichefs_rmtree_node *node)
+{
+	struct inode *dir = d_inode(node->dentry);
+	struct ouichefs_file *files;
+	bool expanded = node->expanded;
+	uint32_t nr;
+	int ret;
+
+	ret = inode_permission(file_mnt_idmap(file), dir, MAY_WRITE | MAY_EXEC);
+	if (ret)
+		return ret;
+	/* Leave sticky directories to rm, which checks owners entry by entry */
+	if ((dir->i_mode & S_ISVTX) && !capable(CAP_FOWNER))
+		return -EPERM;
+
+	inode_lock_nested(dir, I_MUTEX_PARENT);
+	if (IS_DEADDIR(dir)) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+	ret = ouichefs_dir_entries(dir, &files, &nr);
+	if (ret)
+		goto unlock;
+
+	if (!expanded) {
+		ret = ouichefs_rmtree_expand(stack, node, files, nr);
+		/* Come back once the subdirectories queued above are empty */
+		if (ret || list_first_entry(stack, struct ouichefs_rmtree_node,
+					    list) != node)
+			goto free;
+	}
+	ret = ouichefs_rmtree_empty(node->dentry, files, nr);
+	ouichefs_rmtree_pop(node);
+free:
+	kvfree(files);
+unlock:
+	inode_unlock(dir);
+	return ret;
+}
+
+int ouichefs_rmtree(struct file *file)
+{
+	struct ouichefs_rmtree_node *node, *tmp;
+	LIST_HEAD(stack);
+	int ret;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	ret = ouichefs_rmtree_push(&stack, dget(file->f_path.dentry));
+	while (!ret && !list_empty(&stack)) {
+		node = list_first_entry(&stack, struct ouichefs_rmtree_node,
+					list);
+		ret = ouichefs_rmtree_dir(file, &stack, node);
+	}
+	list_for_each_entry_safe(node, tmp, &stack, list)
+		ouichefs_rmtree_pop(node);
+
+	mnt_drop_write_file(file);
+	return ret;
+}
+
+/*
+ * Swap the inodes behind two existing names. Both entries are rewritten in
+ * place, neither name ever disappears.
+ */
+static int ouichefs_exchange(struct inode *old_dir, struct dentry *old_dentry,
+			     struct inode *new_dir, struct dentry *new_dentry)
 {
-	struct super_block *sb = old_dir->i_sb;
-	struct ouichefs_inode_info *ci_old = OUICHEFS_INODE(old_dir);
-	struct ouichefs_inode_info *ci_new = OUICHEFS_INODE(new_dir);
 	struct inode *src = d_inode(old_dentry);
-	struct buffer_head *bh_old = NULL, *bh_new = NULL;
-	struct ouichefs_dir_block *dir_block = NULL;
-	int i, f_id = -1, new_pos = -1, ret, nr_subs, f_pos = -1;
+	struct inode *dst = d_inode(new_dentry);
+	struct ouichefs_usage u;
+	int ret;
+
+	ret = ouichefs_set_entry(old_dir, &old_dentry->d_name, dst->i_ino);
+	if (ret)
+		return ret;
+	ret = ouichefs_set_entry(new_dir, &new_dentry->d_name, src->i_ino);
+	if (ret) {
+		ouichefs_set_entry(old_dir, &old_dentry->d_name, src->i_ino);
+		return ret;
+	}
+
+	if (old_dir != new_dir) {
+		/* Subdirectories hold a link on their parent */
+		if (S_ISDIR(src->i_mode) && !S_ISDIR(dst->i_mode)) {
+			inode_inc_link_count(new_dir);
+			inode_dec_link_count(old_dir);
+		} else if (!S_ISDIR(src->i_mode) && S_ISDIR(dst->i_mode)) {
+			inode_inc_link_count(old_dir);
+			inode_dec_link_count(new_dir);
+		}
+
+		ouichefs_usage_total(src, &u);
+		ouichefs_usage_charge(old_dentry->d_parent, &u, true);
+		ouichefs_usage_charge(new_dentry->d_parent, &u, false);
+		ouichefs_usage_total(dst, &u);
+		ouichefs_usage_charge(new_dentry->d_parent, &u, true);
+		ouichefs_usage_charge(old_dentry->d_parent, &u, false);
+	}
+
+	old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
+	new_dir->i_ctime = new_dir->i_mtime = current_time(new_dir);
+	src->i_ctime = dst->i_ctime = current_time(src);
+	mark_inode_dirty(old_dir);
+	mark_inode_dirty(new_dir);
+	mark_inode_dirty(src);
+	mark_inode_dirty(dst);
+
+	return 0;
+}
+
+/*
+ * Move old_dentry to new_dentry. An existing target is replaced by rewriting
+ * its entry in place, so the new name always points to either the old or the
+ * new inode, then the replaced inode is freed.
+ */
+static int __ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
+			     struct dentry *old_dentry, struct inode *new_dir,
+			     struct dentry *new_dentry, unsigned int flags)
+{
+	struct inode *src = d_inode(old_dentry);
+	struct inode *victim = d_inode(new_dentry);
+	struct ouichefs_usage old_before, new_before, u;
+	int ret;
 
 	/* fail with these unsupported flags */
-	if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
+	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
 		return -EINVAL;
 
 	/* Check if filename is not too long */
-	if (strlen(new_dentry->d_name.name) > OUICHEFS_FILENAME_LEN)
+	if (new_dentry->d_name.len > OUICHEFS_FILENAME_LEN)
 		return -ENAMETOOLONG;
 
-	/* Fail if new_dentry exists or if new_dir is full */
-	bh_new = sb_bread(sb, ci_new->index_block);
-	if (!bh_new)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_new->b_data;
-	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++) {
-		/* if old_dir == new_dir, save the renamed file position */
-		if (new_dir == old_dir) {
-			if (strncmp(dir_block->files[i].filename,
-				    old_dentry->d_name.name,
-				    OUICHEFS_FILENAME_LEN) == 0)
-				f_pos = i;
-		}
-		if (strncmp(dir_block->files[i].filename,
-			    new_dentry->d_name.name,
-			    OUICHEFS_FILENAME_LEN) == 0) {
-			ret = -EEXIST;
-			goto relse_new;
-		}
-		if (new_pos < 0 && dir_block->files[i].inode == 0)
-			new_pos = i;
-	}
-	/* if old_dir == new_dir, just rename entry */
-	if (old_dir == new_dir) {
-		strscpy(dir_block->files[f_pos].filename,
-			new_dentry->d_name.name, OUICHEFS_FILENAME_LEN);
-		mark_buffer_dirty(bh_new);
-		ret = 0;
-		goto relse_new;
+	if (flags & RENAME_EXCHANGE)
+		return ouichefs_exchange(old_dir, old_dentry, new_dir,
+					 new_dentry);
+
+	/* Only empty directories can be replaced */
+	if (victim && S_ISDIR(victim->i_mode)) {
+		ret = ouichefs_dir_is_empty(victim);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -ENOTEMPTY;
 	}
 
-	/* If new directory is empty, fail */
-	if (new_pos < 0) {
-		ret = -EMLINK;
-		goto relse_new;
+	ouichefs_usage_own(old_dir, &old_before);
+	ouichefs_usage_own(new_dir, &new_before);
+
+	/* point the new name to src, adding it if needed (fails if full) */
+	if (victim)
+		ret = ouichefs_set_entry(new_dir, &new_dentry->d_name,
+					 src->i_ino);
+	else
+		ret = ouichefs_add_entry(new_dir, &new_dentry->d_name,
+					 src->i_ino);
+	if (ret)
+		return ret;
+
+	/* remove target from old parent directory */
+	ret = ouichefs_remove_entry(old_dir, &old_dentry->d_name);
+	if (ret) {
+		if (victim)
+			ouichefs_set_entry(new_dir, &new_dentry->d_name,
+					   victim->i_ino);
+		else
+			ouichefs_remove_entry(new_dir, &new_dentry->d_name);
+		return ret;
 	}
 
-	/* insert in new parent directory */
-	dir_block->files[new_pos].inode = cpu_to_le32(src->i_ino);
-	strscpy(dir_block->files[new_pos].filename, new_dentry->d_name.name,
-		OUICHEFS_FILENAME_LEN);
-	mark_buffer_dirty(bh_new);
-	brelse(bh_new);
+	/* Move the usage of src over to its new parents */
+	ouichefs_usage_update(old_dentry->d_parent, old_dir, &old_before);
+	if (old_dir != new_dir) {
+		ouichefs_usage_update(new_dentry->d_parent, new_dir,
+				      &new_before);
+		ouichefs_usage_total(src, &u);
+		ouichefs_usage_charge(old_dentry->d_parent, &u, true);
+		ouichefs_usage_charge(new_dentry->d_parent, &u, false);
+	}
 
-	/* Update new parent inode metadata */
+	/* Update parents inode metadata */
 	new_dir->i_atime = new_dir->i_ctime = new_dir->i_mtime =
 		current_time(new_dir);
-	if (S_ISDIR(src->i_mode))
+	old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
+	if (S_ISDIR(src->i_mode) && old_dir != new_dir) {
 		inode_inc_link_count(new_dir);
+		inode_dec_link_count(old_dir);
+	}
+
+	if (victim) {
+		ouichefs_usage_total(victim, &u);
+		ouichefs_usage_charge(new_dentry->d_parent, &u, true);
+		if (S_ISDIR(victim->i_mode))
+			inode_dec_link_count(new_dir);
+		ouichefs_free_inode(victim);
+	}
 	mark_inode_dirty(new_dir);
+	mark_inode_dirty(old_dir);
 
-	/* remove target from old parent directory */
-	bh_old = sb_bread(sb, ci_old->index_block);
-	if (!bh_old)
-		return -EIO;
-	dir_block = (struct ouichefs_dir_block *)bh_old->b_data;
-	/* Search for inode in old directory and number of subfiles */
-	for (i = 0; OUICHEFS_MAX_SUBFILES; i++) {
-		if (le32_to_cpu(dir_block->files[i].inode) == src->i_ino)
-			f_id = i;
-		else if (dir_block->files[i].inode == 0)
-			break;
+	return 0;
+}
+
+static int ouichefs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
+			   struct dentry *old_dentry, struct inode *new_dir,
+			   struct dentry *new_dentry, unsigned int flags)
+{
+	int ret, retries = 0;
+	bool h;
+
+	do {
+		h = ouichefs_journal_start(old_dir->i_sb);
+		ret = __ouichefs_rename(idmap, old_dir, old_dentry, new_dir,
+					new_dentry, flags);
+		ouichefs_journal_stop(old_dir->i_sb, h);
+	} while (ret == -ENOSPC &&
+		 ouichefs_journal_retry_alloc(old_dir->i_sb, &retries));
+	return ret;
+}
+
+/*
+ * Create an unnamed file for O_TMPFILE. It stays out of the directory, so it
+ * costs no directory I/O, until linkat() gives it a name.
+ */
+static int __ouichefs_tmpfile(struct mnt_idmap *idmap, struct inode *dir,
+			      struct file *file, umode_t mode)
+{
+	struct inode *inode;
+
+	inode = ouichefs_new_inode(dir, mode);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	OUICHEFS_INODE(inode)->i_flags |= OUICHEFS_INODE_ORPHAN;
+	mark_inode_dirty(inode);
+	ouichefs_orphan_add(dir->i_sb);
+	if (S_ISREG(mode)) {
+		struct ouichefs_sb_info *sbi = OUICHEFS_SB(dir->i_sb);
+		sbi->files++;
 	}
-	nr_subs = i;
 
-	/* Remove file from old parent directory */
-	if (f_id != OUICHEFS_MAX_SUBFILES - 1)
-		memmove(dir_block->files + f_id, dir_block->files + f_id + 1,
-			(nr_subs - f_id - 1) * sizeof(struct ouichefs_file));
-	memset(&dir_block->files[nr_subs - 1], 0, sizeof(struct ouichefs_file));
-	mark_buffer_dirty(bh_old);
-	brelse(bh_old);
+	/* Drops the link from ouichefs_new_inode() */
+	d_tmpfile(file, inode);
 
-	/* Update old parent inode metadata */
-	old_dir->i_ctime = old_dir->i_mtime = current_time(old_dir);
-	if (S_ISDIR(src->i_mode))
-		inode_dec_link_count(old_dir);
-	mark_inode_dirty(old_dir);
+	return finish_open_simple(file, 0);
+}
+
+static int ouichefs_tmpfile(struct mnt_idmap *idmap, struct inode *dir,
+			    struct file *file, umode_t mode)
+{
+	int ret, retries = 0;
+	bool h;
+
+	do {
+		h = ouichefs_journal_start(dir->i_sb);
+		ret = __ouichefs_tmpfile(idmap, dir, file, mode);
+		ouichefs_journal_stop(dir->i_sb, h);
+	} while (ret == -ENOSPC &&
+		 ouichefs_journal_retry_alloc(dir->i_sb, &retries));
+	return ret;
+}
+
+/*
+ * Give a name to an O_TMPFILE inode. Files only ever have a single name, so
+ * this is the only kind of link supported.
+ */
+static int __ouichefs_link(struct dentry *old_dentry, struct inode *dir,
+			   struct dentry *dentry)
+{
+	struct inode *inode = d_inode(old_dentry);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_usage before, u;
+	int ret;
+
+	if (!(ci->i_flags & OUICHEFS_INODE_ORPHAN))
+		return -EPERM;
+	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	ouichefs_usage_own(dir, &before);
+	ret = ouichefs_add_entry(dir, &dentry->d_name, inode->i_ino);
+	if (ret)
+		return ret;
+	ouichefs_usage_update(dentry->d_parent, dir, &before);
+
+	ci->i_flags &= ~OUICHEFS_INODE_ORPHAN;
+	ouichefs_orphan_del(dir->i_sb);
+	ouichefs_usage_total(inode, &u);
+	ouichefs_usage_charge(dentry->d_parent, &u, false);
+
+	inc_nlink(inode);
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+
+	ihold(inode);
+	d_instantiate(dentry, inode);
 
 	return 0;
+}
 
-relse_new:
-	brelse(bh_new);
+static int ouichefs_link(struct dentry *old_dentry, struct inode *dir,
+			 struct dentry *dentry)
+{
+	int ret, retries = 0;
+	bool h;
+
+	do {
+		h = ouichefs_journal_start(dir->i_sb);
+		ret = __ouichefs_link(old_dentry, dir, dentry);
+		ouichefs_journal_stop(dir->i_sb, h);
+	} while (ret == -ENOSPC &&
+		 ouichefs_journal_retry_alloc(dir->i_sb, &retries));
 	return ret;
 }
 
@@ -614,28 +1342,154 @@ static int ouichefs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 static int ouichefs_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	struct super_block *sb = dir->i_sb;
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh;
-	struct ouichefs_dir_block *dblock;
+	int ret;
 
 	/* If the directory is not empty, fail */
 	if (inode->i_nlink > 2)
 		return -ENOTEMPTY;
-	bh = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh)
-		return -EIO;
-	dblock = (struct ouichefs_dir_block *)bh->b_data;
-	if (dblock->files[0].inode != 0) {
-		brelse(bh);
+	ret = ouichefs_dir_is_empty(inode);
+	if (ret < 0)
+		return ret;
+	if (!ret)
 		return -ENOTEMPTY;
-	}
-	brelse(bh);
 
 	/* Remove directory with unlink */
 	return ouichefs_unlink(dir, dentry);
 }
 
+/*
+ * Create a symlink. Targets that fit in the inline data area of the inode are
+ * stored there, longer ones in a run of slices like small files.
+ */
+static int __ouichefs_symlink(struct mnt_idmap *idmap, struct inode *dir,
+			      struct dentry *dentry, const char *symname)
+{
+	struct super_block *sb = dir->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_inode_info *ci;
+	struct ouichefs_usage before, u;
+	struct inode *inode;
+	struct buffer_head *bh;
+	size_t len = strlen(symname);
+	uint32_t bno, slice, nr_slices;
+	int ret;
+
+	/* Check filename and target length */
+	if (dentry->d_name.len > OUICHEFS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	if (len >= sb->s_blocksize)
+		return -ENAMETOOLONG;
+
+	/* Get a new free inode */
+	inode = ouichefs_new_inode(dir, S_IFLNK | S_IRWXUGO);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	ci = OUICHEFS_INODE(inode);
+
+	if (len <= sbi->inline_size) {
+		memcpy(ci->i_data, symname, len);
+	} else {
+		nr_slices = DIV_ROUND_UP(len, sbi->s_slice_size);
+		ret = ouichefs_alloc_slices(sb, nr_slices,
+					    ouichefs_slice_hint(dir), &bno, &slice);
+		if (ret)
+			goto iput;
+		ouichefs_set_slice_hint(dir, bno);
+		bh = sb_bread(sb, bno);
+		if (!bh) {
+			ouichefs_free_slices(sb, bno, slice, nr_slices);
+			ret = -EIO;
+			goto iput;
+		}
+		memset(bh->b_data + slice * sbi->s_slice_size, 0,
+		       nr_slices * sbi->s_slice_size);
+		memcpy(bh->b_data + slice * sbi->s_slice_size, symname, len);
+		/* Logged, the block may hold directory entries */
+		ouichefs_journal_dirty(sb, bh);
+		brelse(bh);
+		ci->index_block = pack_slice_ptr(bno, slice);
+		ci->i_flags |= OUICHEFS_INODE_SLICED;
+	}
+	inode->i_size = len;
+
+	/* Register new inode in parent directory */
+	ouichefs_usage_own(dir, &before);
+	ret = ouichefs_add_entry(dir, &dentry->d_name, inode->i_ino);
+	if (ret) {
+		if (ouichefs_is_sliced(inode))
+			release_slice(inode);
+		goto iput;
+	}
+	ouichefs_usage_update(dentry->d_parent, dir, &before);
+	ouichefs_usage_total(inode, &u);
+	ouichefs_usage_charge(dentry->d_parent, &u, false);
+
+	mark_inode_dirty(inode);
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	mark_inode_dirty(dir);
+	d_instantiate(dentry, inode);
+
+	return 0;
+
+iput:
+	put_inode(sbi, inode->i_ino);
+	clear_nlink(inode);
+	iput(inode);
+	return ret;
+}
+
+static int ouichefs_symlink(struct mnt_idmap *idmap, struct inode *dir,
+			    struct dentry *dentry, const char *symname)
+{
+	int ret, retries = 0;
+	bool h;
+
+	do {
+		h = ouichefs_journal_start(dir->i_sb);
+		ret = __ouichefs_symlink(idmap, dir, dentry, symname);
+		ouichefs_journal_stop(dir->i_sb, h);
+	} while (ret == -ENOSPC &&
+		 ouichefs_journal_retry_alloc(dir->i_sb, &retries));
+	return ret;
+}
+
+/*
+ * Inline targets are returned as is, even in RCU walk mode. Targets stored in
+ * slices are read from their sliced block.
+ */
+static const char *ouichefs_get_link(struct dentry *dentry, struct inode *inode,
+				     struct delayed_call *done)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	char *link;
+
+	if (!ouichefs_is_sliced(inode))
+		return ci->i_data;
+	if (!dentry)
+		return ERR_PTR(-ECHILD);
+
+	link = kmalloc(inode->i_size + 1, GFP_KERNEL);
+	if (!link)
+		return ERR_PTR(-ENOMEM);
+	bh = sb_bread(sb, extract_block_num(ci->index_block));
+	if (!bh) {
+		kfree(link);
+		return ERR_PTR(-EIO);
+	}
+	memcpy(link, bh->b_data +
+	       extract_slice_num(ci->index_block) * sbi->s_slice_size,
+	       inode->i_size);
+	link[inode->i_size] = '\0';
+	brelse(bh);
+
+	set_delayed_call(done, kfree_link, link);
+	return link;
+}
+
 static const struct inode_operations ouichefs_inode_ops = {
 	.lookup = ouichefs_lookup,
 	.create = ouichefs_create,
@@ -643,4 +1497,11 @@ static const struct inode_operations ouichefs_inode_ops = {
 	.mkdir = ouichefs_mkdir,
 	.rmdir = ouichefs_rmdir,
 	.rename = ouichefs_rename,
+	.symlink = ouichefs_symlink,
+	.tmpfile = ouichefs_tmpfile,
+	.link = ouichefs_link,
+};
+
+static const struct inode_operations ouichefs_symlink_inode_ops = {
+	.get_link = ouichefs_get_link,
 };
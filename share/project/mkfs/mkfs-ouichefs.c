@@ -0,0 +1,628 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ *
+ * LKP: layout updated for the slice map region and 64-bit slice pointers,
+ * block and slice sizes can be chosen, metadata journal area.
+ */
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define OUICHEFS_MAGIC 0x48434957
+
+#define OUICHEFS_SB_BLOCK_NR 0
+
+#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB, minimum and default */
+#define OUICHEFS_MAX_BLOCK_SIZE (1 << 16) /* 64 KiB */
+#define OUICHEFS_FILENAME_LEN 28
+#define OUICHEFS_MAX_SUBFILES 128
+
+#define OUICHEFS_SLICE_SIZE 128 /* default */
+#define OUICHEFS_MAX_SLICES_PER_BLOCK 64
+
+/* Geometry of the partition being formatted */
+static uint32_t block_size = OUICHEFS_BLOCK_SIZE;
+static uint32_t slice_size = OUICHEFS_SLICE_SIZE;
+/* Blocks of the journal area, -1 for the default size */
+static long journal_blocks = -1;
+
+/* must be kept in sync with ouichefs.h */
+struct ouichefs_inode {
+	uint32_t i_mode; /* File mode */
+	uint32_t i_uid; /* Owner id */
+	uint32_t i_gid; /* Group id */
+	uint32_t i_size; /* Size in bytes */
+	uint32_t i_ctime; /* Inode change time (sec)*/
+	uint64_t i_nctime; /* Inode change time (nsec) */
+	uint32_t i_atime; /* Access time (sec) */
+	uint64_t i_natime; /* Access time (nsec) */
+	uint32_t i_mtime; /* Modification time (sec) */
+	uint64_t i_nmtime; /* Modification time (nsec) */
+	uint32_t i_blocks; /* Block count */
+	uint32_t i_nlink; /* Hard links count */
+	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
+	uint32_t index_hi; /* Upper half of index_block (OUICHEFS_FEATURE_SLICE64) */
+	uint8_t i_data[]; /* Inline data, up to OUICHEFS_INODE_SIZE */
+};
+
+/* On-disk inode size, the tail past struct ouichefs_inode is inline data */
+#define OUICHEFS_INODE_SIZE 128
+
+#define OUICHEFS_INODES_PER_BLOCK \
+	(block_size / OUICHEFS_INODE_SIZE)
+
+struct ouichefs_sliced_block_meta {
+	uint64_t slice_bitmap; /* free slices of the block (1 = free) */
+	uint32_t next_partial_block; /* next partially used sliced block */
+	uint32_t reserved;
+};
+
+#define OUICHEFS_SMAP_PER_BLOCK \
+	(block_size / sizeof(struct ouichefs_sliced_block_meta))
+
+struct ouichefs_sb_info {
+	uint32_t magic; /* Magic number */
+
+	uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
+	uint32_t nr_inodes; /* Total number of inodes */
+
+	uint32_t nr_istore_blocks; /* Number of inode store blocks */
+	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
+	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+
+	uint32_t nr_free_inodes; /* Number of free inodes */
+	uint32_t nr_free_blocks; /* Number of free blocks */
+
+	uint32_t nr_smap_blocks; /* Number of slice map blocks */
+	uint32_t s_free_sliced_blocks; /* Head of partial sliced blocks list */
+	uint32_t s_features; /* OUICHEFS_FEATURE_* flags */
+	uint32_t s_block_size; /* Block size in bytes */
+	uint32_t s_slice_size; /* Slice size in bytes */
+	uint32_t s_inode_size; /* On-disk inode size */
+	uint32_t s_journal_start; /* First block of the journal area */
+	uint32_t s_journal_blocks; /* Blocks of the journal area */
+	uint32_t s_nr_orphans; /* O_TMPFILE inodes neither linked nor freed */
+};
+
+/* 64-bit slice pointers, sliced blocks can live anywhere on the partition */
+#define OUICHEFS_FEATURE_SLICE64 0x1
+/* Directories keep the usage of their entries in their inline data area */
+#define OUICHEFS_FEATURE_DIR_USAGE 0x2
+/* Metadata changes are logged to the journal area before going home */
+#define OUICHEFS_FEATURE_JOURNAL 0x4
+
+/* Size of the descriptor heading each half of the journal area */
+#define OUICHEFS_JOURNAL_DESC_SIZE 20
+/* Smallest journal the kernel accepts, room for a few operations per commit */
+#define OUICHEFS_JOURNAL_MIN_BLOCKS 128
+
+/* Usage of a directory and its entries, at the start of its inline data */
+struct ouichefs_disk_usage {
+	uint64_t bytes;
+	uint64_t slices;
+	uint64_t blocks;
+	uint64_t files;
+} __attribute__((packed));
+
+/* Legacy 32-bit slice pointers only address the first 2^27 blocks */
+#define OUICHEFS_SLICE32_MAX_BLOCKS (1U << 27)
+/* and only have room for 32 slice numbers */
+#define OUICHEFS_SLICE32_MAX_SLICES 32
+
+/* padded to block_size on disk */
+struct superblock {
+	struct ouichefs_sb_info info;
+};
+
+struct ouichefs_dir_block {
+	struct ouichefs_file {
+		uint32_t inode;
+		char filename[OUICHEFS_FILENAME_LEN];
+	} files[OUICHEFS_MAX_SUBFILES];
+};
+
+static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
+{
+	return (a / b) + !!(a % b);
+}
+
+static inline void usage(char *appname)
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"%s [-w] [-b block_size] [-s slice_size] [-j blocks] disk\n"
+		"\t-w\tuse 64-bit slice pointers (always on above %u blocks)\n"
+		"\t-b\tblock size in bytes, power of 2 from %u to %u (default %u)\n"
+		"\t-s\tslice size in bytes, power of 2, at most %u slices per\n"
+		"\t\tblock (default %u)\n"
+		"\t-j\tblocks of the metadata journal, 0 for none, at least %u\n"
+		"\t\t(default 1/16th of the partition, capped to what a commit\n"
+		"\t\tcan use, none if the minimum is above 1/4th of it)\n",
+		appname, OUICHEFS_SLICE32_MAX_BLOCKS, OUICHEFS_BLOCK_SIZE,
+		OUICHEFS_MAX_BLOCK_SIZE, OUICHEFS_BLOCK_SIZE,
+		OUICHEFS_MAX_SLICES_PER_BLOCK, OUICHEFS_SLICE_SIZE,
+		OUICHEFS_JOURNAL_MIN_BLOCKS);
+}
+
+static inline int is_power_of_2(uint32_t n)
+{
+	return n && !(n & (n - 1));
+}
+
+static uint32_t first_data_block(struct superblock *sb)
+{
+	return 1 + le32toh(sb->info.nr_istore_blocks) +
+	       le32toh(sb->info.nr_ifree_blocks) +
+	       le32toh(sb->info.nr_bfree_blocks) +
+	       le32toh(sb->info.nr_smap_blocks) +
+	       le32toh(sb->info.s_journal_blocks);
+}
+
+/*
+ * Journal size for a partition of nr_blocks blocks: two halves of a descriptor
+ * and the blocks it can list, at least OUICHEFS_JOURNAL_MIN_BLOCKS in total.
+ */
+static uint32_t journal_size(uint32_t nr_blocks)
+{
+	uint32_t max = 2 * (1 + (block_size - OUICHEFS_JOURNAL_DESC_SIZE) / 4);
+	uint32_t n;
+
+	if (journal_blocks >= 0) {
+		n = journal_blocks;
+	} else {
+		n = nr_blocks / 16;
+		if (OUICHEFS_JOURNAL_MIN_BLOCKS > nr_blocks / 4)
+			return 0;
+	}
+	if (!n)
+		return 0;
+	if (n < OUICHEFS_JOURNAL_MIN_BLOCKS)
+		n = OUICHEFS_JOURNAL_MIN_BLOCKS;
+	if (n > max)
+		n = max;
+	return n & ~1U;
+}
+
+static struct superblock *write_superblock(int fd, struct stat *fstats,
+					   uint32_t features)
+{
+	struct superblock *sb = calloc(1, block_size);
+	uint32_t nr_blocks, nr_inodes, mod, nr_istore_blocks, nr_ifree_blocks;
+	uint32_t nr_bfree_blocks, nr_smap_blocks, nr_data_blocks;
+	uint32_t nr_journal_blocks;
+	int ret;
+
+	if (!sb)
+		return NULL;
+
+	nr_blocks = fstats->st_size / block_size;
+	nr_inodes = nr_blocks;
+	mod = nr_inodes % OUICHEFS_INODES_PER_BLOCK;
+	if (mod)
+		nr_inodes += OUICHEFS_INODES_PER_BLOCK - mod;
+	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
+	nr_ifree_blocks = idiv_ceil(nr_inodes, block_size * 8);
+	nr_bfree_blocks = idiv_ceil(nr_blocks, block_size * 8);
+	/* one slice map entry per block of the partition */
+	nr_smap_blocks = idiv_ceil(nr_blocks, OUICHEFS_SMAP_PER_BLOCK);
+	/* the journal area sits between the slice map and the data blocks */
+	nr_journal_blocks = journal_size(nr_blocks);
+	if (nr_journal_blocks)
+		features |= OUICHEFS_FEATURE_JOURNAL;
+	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
+			 nr_bfree_blocks - nr_smap_blocks - nr_journal_blocks;
+	if (nr_blocks > OUICHEFS_SLICE32_MAX_BLOCKS ||
+	    block_size / slice_size > OUICHEFS_SLICE32_MAX_SLICES)
+		features |= OUICHEFS_FEATURE_SLICE64;
+
+	sb->info = (struct ouichefs_sb_info){
+		.magic = htole32(OUICHEFS_MAGIC),
+		.nr_blocks = htole32(nr_blocks),
+		.nr_inodes = htole32(nr_inodes),
+		.nr_istore_blocks = htole32(nr_istore_blocks),
+		.nr_ifree_blocks = htole32(nr_ifree_blocks),
+		.nr_bfree_blocks = htole32(nr_bfree_blocks),
+		.nr_free_inodes = htole32(nr_inodes - 1),
+		.nr_free_blocks = htole32(nr_data_blocks - 1),
+		.nr_smap_blocks = htole32(nr_smap_blocks),
+		.s_free_sliced_blocks = 0,
+		.s_features = htole32(features),
+		.s_block_size = htole32(block_size),
+		.s_slice_size = htole32(slice_size),
+		.s_inode_size = htole32(OUICHEFS_INODE_SIZE),
+		.s_journal_start = htole32(nr_journal_blocks ?
+					   1 + nr_istore_blocks +
+					   nr_ifree_blocks + nr_bfree_blocks +
+					   nr_smap_blocks : 0),
+		.s_journal_blocks = htole32(nr_journal_blocks),
+	};
+
+	ret = write(fd, sb, block_size);
+	if (ret != (ssize_t)block_size) {
+		free(sb);
+		return NULL;
+	}
+
+	printf("Superblock: (%u)\n"
+	       "\tmagic=%#x\n"
+	       "\tblock_size=%u\n"
+	       "\tslice_size=%u\n"
+	       "\tnr_blocks=%u\n"
+	       "\tnr_inodes=%u (istore=%u blocks)\n"
+	       "\tnr_ifree_blocks=%u\n"
+	       "\tnr_bfree_blocks=%u\n"
+	       "\tnr_smap_blocks=%u\n"
+	       "\tjournal=%u blocks at %u\n"
+	       "\tnr_free_inodes=%u\n"
+	       "\tnr_free_blocks=%u\n"
+	       "\tfeatures=%#x\n",
+	       block_size, sb->info.magic, block_size, slice_size,
+	       sb->info.nr_blocks,
+	       sb->info.nr_inodes, sb->info.nr_istore_blocks,
+	       sb->info.nr_ifree_blocks, sb->info.nr_bfree_blocks,
+	       sb->info.nr_smap_blocks, sb->info.s_journal_blocks,
+	       sb->info.s_journal_start, sb->info.nr_free_inodes,
+	       sb->info.nr_free_blocks, sb->info.s_features);
+
+	return sb;
+}
+
+static int write_inode_store(int fd, struct superblock *sb)
+{
+	struct ouichefs_inode *inode;
+	char *block;
+	uint32_t i;
+	int ret;
+
+	/* Allocate a zeroed block for inode store */
+	block = calloc(1, block_size);
+	if (!block)
+		return -1;
+
+	/* Root inode (inode 1) */
+	inode = (struct ouichefs_inode *)(block + OUICHEFS_INODE_SIZE);
+	inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
+				S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
+	inode->i_uid = 0;
+	inode->i_gid = 0;
+	inode->i_size = htole32(block_size);
+	inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
+	inode->i_blocks = htole32(1);
+	inode->i_nlink = htole32(2);
+	inode->index_block = htole32(first_data_block(sb));
+	if (le32toh(sb->info.s_features) & OUICHEFS_FEATURE_DIR_USAGE) {
+		struct ouichefs_disk_usage *du = (void *)inode->i_data;
+
+		/* The root directory only holds its own block */
+		du->blocks = htole64(1);
+	}
+
+	ret = write(fd, block, block_size);
+	if (ret != (ssize_t)block_size) {
+		ret = -1;
+		goto end;
+	}
+
+	/* Reset inode store blocks to zero */
+	memset(block, 0, block_size);
+	for (i = 1; i < le32toh(sb->info.nr_istore_blocks); i++) {
+		ret = write(fd, block, block_size);
+		if (ret != (ssize_t)block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Inode store: wrote %d blocks\n"
+	       "\tinode size = %d B (%ld B of inline data)\n",
+	       i, OUICHEFS_INODE_SIZE,
+	       OUICHEFS_INODE_SIZE - sizeof(struct ouichefs_inode));
+
+end:
+	free(block);
+	return ret;
+}
+
+static int write_ifree_blocks(int fd, struct superblock *sb)
+{
+	uint64_t *ifree = malloc(block_size);
+	uint32_t i;
+	int ret;
+
+	if (!ifree)
+		return -1;
+
+	/* Set all bits to 1 */
+	memset(ifree, 0xff, block_size);
+
+	/* First ifree block, containing first used inode (0 and root) */
+	ifree[0] = htole64(0xfffffffffffffffc);
+	ret = write(fd, ifree, block_size);
+	if (ret != (ssize_t)block_size) {
+		ret = -1;
+		goto end;
+	}
+
+	/* All ifree blocks except the one containing 2 first inodes */
+	ifree[0] = 0xffffffffffffffff;
+	for (i = 1; i < le32toh(sb->info.nr_ifree_blocks); i++) {
+		ret = write(fd, ifree, block_size);
+		if (ret != (ssize_t)block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Ifree blocks: wrote %d blocks\n", i);
+
+end:
+	free(ifree);
+	return ret;
+}
+
+static int write_bfree_blocks(int fd, struct superblock *sb)
+{
+	uint64_t *bfree = malloc(block_size);
+	uint32_t nr_used = first_data_block(sb) + 1; /* metadata + root dir */
+	uint32_t i, j;
+	int ret;
+
+	if (!bfree)
+		return -1;
+
+	for (i = 0; i < le32toh(sb->info.nr_bfree_blocks); i++) {
+		/* Set all bits to 1, then clear the ones of used blocks */
+		memset(bfree, 0xff, block_size);
+		for (j = 0; j < block_size * 8; j++) {
+			uint64_t bit = (uint64_t)i * block_size * 8 + j;
+
+			if (bit >= nr_used)
+				break;
+			bfree[j / 64] &= ~(1ULL << (j % 64));
+		}
+		for (j = 0; j < block_size / 8; j++)
+			bfree[j] = htole64(bfree[j]);
+
+		ret = write(fd, bfree, block_size);
+		if (ret != (ssize_t)block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Bfree blocks: wrote %d blocks\n", i);
+
+end:
+	free(bfree);
+	return ret;
+}
+
+static int write_smap_blocks(int fd, struct superblock *sb)
+{
+	char *block = calloc(1, block_size);
+	uint32_t i;
+	int ret;
+
+	if (!block)
+		return -1;
+
+	/* No sliced block yet, all entries start zeroed */
+	for (i = 0; i < le32toh(sb->info.nr_smap_blocks); i++) {
+		ret = write(fd, block, block_size);
+		if (ret != (ssize_t)block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Slice map blocks: wrote %d blocks\n", i);
+
+end:
+	free(block);
+	return ret;
+}
+
+static int write_journal_blocks(int fd, struct superblock *sb)
+{
+	char *block = calloc(1, block_size);
+	uint32_t i;
+	int ret;
+
+	if (!block)
+		return -1;
+
+	/* Zeroed descriptors, nothing to replay at first mount */
+	for (i = 0; i < le32toh(sb->info.s_journal_blocks); i++) {
+		ret = write(fd, block, block_size);
+		if (ret != (ssize_t)block_size) {
+			ret = -1;
+			goto end;
+		}
+	}
+	ret = 0;
+
+	printf("Journal blocks: wrote %d blocks\n", i);
+
+end:
+	free(block);
+	return ret;
+}
+
+static int write_data_blocks(int fd)
+{
+	char *block = calloc(1, block_size);
+	int ret;
+
+	if (!block)
+		return -1;
+
+	/* Empty root directory block */
+	ret = write(fd, block, block_size);
+	free(block);
+	if (ret != (ssize_t)block_size)
+		return -1;
+
+	printf("Data blocks: wrote root directory block\n");
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct superblock *sb = NULL;
+	struct stat stat_buf;
+	uint32_t features = OUICHEFS_FEATURE_DIR_USAGE;
+	int ret = EXIT_SUCCESS, fd, opt;
+	long int min_size;
+
+	while ((opt = getopt(argc, argv, "wb:s:j:")) != -1) {
+		switch (opt) {
+		case 'w':
+			features |= OUICHEFS_FEATURE_SLICE64;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			slice_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			journal_blocks = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (!is_power_of_2(block_size) || block_size < OUICHEFS_BLOCK_SIZE ||
+	    block_size > OUICHEFS_MAX_BLOCK_SIZE) {
+		fprintf(stderr, "Invalid block size %u\n", block_size);
+		return EXIT_FAILURE;
+	}
+	if (!is_power_of_2(slice_size) || slice_size > block_size ||
+	    block_size / slice_size > OUICHEFS_MAX_SLICES_PER_BLOCK) {
+		fprintf(stderr, "Invalid slice size %u for %u-byte blocks\n",
+			slice_size, block_size);
+		return EXIT_FAILURE;
+	}
+
+	/* Open disk image */
+	fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		perror("open():");
+		return EXIT_FAILURE;
+	}
+
+	/* Get image size */
+	ret = fstat(fd, &stat_buf);
+	if (ret) {
+		perror("fstat():");
+		ret = EXIT_FAILURE;
+		goto fclose;
+	}
+
+	/* Get block device size */
+	if ((stat_buf.st_mode & S_IFMT) == S_IFBLK) {
+		long int blk_size = 0;
+
+		ret = ioctl(fd, BLKGETSIZE64, &blk_size);
+		if (ret != 0) {
+			perror("BLKGETSIZE64:");
+			ret = EXIT_FAILURE;
+			goto fclose;
+		}
+		stat_buf.st_size = blk_size;
+	}
+
+	/* Check if image is large enough */
+	min_size = 100 * (long int)block_size;
+	if (stat_buf.st_size < min_size) {
+		fprintf(stderr, "File is not large enough (size=%ld, min size=%ld)\n",
+			stat_buf.st_size, min_size);
+		ret = EXIT_FAILURE;
+		goto fclose;
+	}
+
+	/* Write superblock (block 0) */
+	sb = write_superblock(fd, &stat_buf, features);
+	if (!sb) {
+		perror("write_superblock():");
+		ret = EXIT_FAILURE;
+		goto fclose;
+	}
+
+	/* Write inode store blocks (from block 1) */
+	ret = write_inode_store(fd, sb);
+	if (ret) {
+		perror("write_inode_store():");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write inode free bitmap blocks */
+	ret = write_ifree_blocks(fd, sb);
+	if (ret) {
+		perror("write_ifree_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write block free bitmap blocks */
+	ret = write_bfree_blocks(fd, sb);
+	if (ret) {
+		perror("write_bfree_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write slice map blocks */
+	ret = write_smap_blocks(fd, sb);
+	if (ret) {
+		perror("write_smap_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write journal blocks */
+	ret = write_journal_blocks(fd, sb);
+	if (ret) {
+		perror("write_journal_blocks()");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+	/* Write data blocks */
+	ret = write_data_blocks(fd);
+	if (ret) {
+		perror("write_data_blocks():");
+		ret = EXIT_FAILURE;
+		goto free_sb;
+	}
+
+free_sb:
+	free(sb);
+fclose:
+	close(fd);
+
+	return ret;
+}
@@ -8,8 +8,16 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/buffer_head.h>
 #include <linux/kobject.h>
 #include <linux/ioctl.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/xarray.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
@@ -17,12 +25,42 @@
 #define OUICHEFS_IOCTL_MAGIC 'O'
 #define OUICHEFS_IOCTL_DUMP_BLOCK _IO(OUICHEFS_IOCTL_MAGIC, 0x01)
 
+/*
+ * Space used below a directory, the directory itself included, as returned by
+ * OUICHEFS_IOCTL_DIR_USAGE. Each directory keeps what it holds directly up to
+ * date, the ioctl sums them over the subtree.
+ */
+struct ouichefs_usage {
+	__u64 bytes; /* Size of regular files and symlinks */
+	__u64 slices; /* Slices in use */
+	__u64 blocks; /* Whole blocks in use, index blocks included */
+	__u64 files; /* Inodes below the directory, directories included */
+};
+
+#define OUICHEFS_IOCTL_DIR_USAGE \
+	_IOR(OUICHEFS_IOCTL_MAGIC, 0x02, struct ouichefs_usage)
+
+/* Remove everything below a directory, which is left empty */
+#define OUICHEFS_IOCTL_RMTREE _IO(OUICHEFS_IOCTL_MAGIC, 0x03)
+
+/*
+ * Atomic replace mode of a regular file, persistent, 0 or 1. Writes of small
+ * files go to fresh slices and the inode switches to them in a single write,
+ * so a crash leaves either the old or the new content. Writes land at their
+ * offset, the rest of the content is copied over to the fresh slices.
+ */
+#define OUICHEFS_IOCTL_GET_ATOMIC _IOR(OUICHEFS_IOCTL_MAGIC, 0x04, __u32)
+#define OUICHEFS_IOCTL_SET_ATOMIC _IOW(OUICHEFS_IOCTL_MAGIC, 0x05, __u32)
+
 #define OUICHEFS_SB_BLOCK_NR 0
 
-#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+/*
+ * Block and slice sizes are chosen at mkfs time and recorded in the superblock.
+ * The superblock itself is always read with the minimum block size.
+ */
+#define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB, minimum and default */
+#define OUICHEFS_MAX_BLOCK_SIZE (1 << 16) /* 64 KiB */
 #define OUICHEFS_FILENAME_LEN 28
-#define OUICHEFS_MAX_SUBFILES 128
 
 /*
  * ouiche_fs partition layout
@@ -36,6 +74,10 @@
  * +---------------+
  * | bfree bitmap  |  sb->nr_bfree_blocks blocks
  * +---------------+
+ * |  slice map    |  sb->nr_smap_blocks blocks
+ * +---------------+
+ * |   journal     |  sb->s_journal_blocks blocks (FEATURE_JOURNAL)
+ * +---------------+
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
@@ -44,9 +86,29 @@
 
 // LKP import from inode.c
 void release_slice(struct inode *inode);
+void ouichefs_free_inode(struct inode *inode);
+void ouichefs_reclaim_work(struct work_struct *work);
+int ouichefs_rmtree(struct file *file);
+void ouichefs_usage_own(struct inode *inode, struct ouichefs_usage *u);
+void ouichefs_usage_update(struct dentry *dentry, struct inode *inode,
+			   const struct ouichefs_usage *before);
+void ouichefs_usage_read(struct inode *dir, struct ouichefs_usage *u);
+int ouichefs_usage_subtree(struct inode *dir, struct ouichefs_usage *u);
+
+// Default size of a slice, and maximum number of slices in a sliced block
+#define OUICHEFS_SLICE_SIZE		128
+#define OUICHEFS_MAX_SLICES_PER_BLOCK	64
 
-// Number of bits used to store the slice number (we have at most 32 slices)
+/*
+ * Slice pointers are 64 bits wide in memory: block number in the lower 32 bits
+ * and slice number above. On disk, images with OUICHEFS_FEATURE_SLICE64 store
+ * them the same way (index_block and index_hi), legacy images squeeze them in
+ * 32 bits, which only addresses the first 2^27 blocks.
+ */
+
+// Number of bits used to store the slice number in a legacy slice pointer
 #define SLICE_BITS      5
+#define SLICE32_MAX_SLICES (1 << SLICE_BITS)
 
 // Mask to isolate the 5 bits used for the slice number (0b11111 = 0x1F)
 #define SLICE_MASK      0x1F
@@ -54,23 +116,36 @@ void release_slice(struct inode *inode);
 // Mask to isolate the lower 27 bits for the block number (0x07FFFFFF)
 #define BLOCK_MASK      0x07FFFFFF
 
-// Pack a block number (lower 27 bits) and slice number (upper 5 bits) into a 32-bit value
-static inline uint32_t pack_slice_ptr(uint32_t block_num, uint8_t slice_num)
+// Pack a block number and a slice number into a 64-bit slice pointer
+static inline uint64_t pack_slice_ptr(uint32_t block_num, uint8_t slice_num)
 {
-    // Mask the slice number to 5 bits, shift it to bits 31–27, then OR with masked block number
-	return ((slice_num & SLICE_MASK) << 27) | (block_num & BLOCK_MASK);
+	return ((uint64_t)slice_num << 32) | block_num;
+}
+
+// Extract the block number (lower 32 bits) from a packed slice_ptr
+static inline uint32_t extract_block_num(uint64_t packed_val)
+{
+	return packed_val & 0xFFFFFFFF;
 }
 
-// Extract the block number (lower 27 bits) from a packed slice_ptr
-static inline uint32_t extract_block_num(uint32_t packed_val)
+// Extract the slice number (upper 32 bits) from a packed slice_ptr
+static inline uint8_t extract_slice_num(uint64_t packed_val)
 {
-	return packed_val & BLOCK_MASK;
+	return packed_val >> 32;
 }
 
-// Extract the slice number (upper 5 bits) from a packed slice_ptr
-static inline uint8_t extract_slice_num(uint32_t packed_val)
+// Pack a block number (lower 27 bits) and slice number (upper 5 bits) into a legacy 32-bit value
+static inline uint32_t pack_slice_ptr32(uint32_t block_num, uint8_t slice_num)
 {
-	return (packed_val >> 27) & SLICE_MASK;
+    // Mask the slice number to 5 bits, shift it to bits 31–27, then OR with masked block number
+	return ((slice_num & SLICE_MASK) << 27) | (block_num & BLOCK_MASK);
+}
+
+// Widen a legacy 32-bit slice pointer
+static inline uint64_t unpack_slice_ptr32(uint32_t packed_val)
+{
+	return pack_slice_ptr(packed_val & BLOCK_MASK,
+			      (packed_val >> 27) & SLICE_MASK);
 }
 
 struct ouichefs_inode {
@@ -87,23 +162,100 @@ struct ouichefs_inode {
 	__le32 i_blocks; /* Block count */
 	__le32 i_nlink; /* Hard links count */
 	__le32 index_block; /* Block with list of blocks for this file */
+	__le32 i_flags; /* OUICHEFS_INODE_* flags */
+	__le32 index_hi; /* Upper half of index_block (OUICHEFS_FEATURE_SLICE64) */
+	__u8 i_data[]; /* Inline data, up to the on-disk inode size */
 };
 
-// LKP impl. struct to help describing a silced block
+/*
+ * On-disk size of inodes on new partitions, recorded in the superblock.
+ * Partitions formatted before it was recorded are refused at mount.
+ */
+#define OUICHEFS_INODE_SIZE	128
+#define OUICHEFS_INLINE_MAX	(OUICHEFS_INODE_SIZE - sizeof(struct ouichefs_inode))
+
+/* index_block holds a packed slice pointer instead of a block number */
+#define OUICHEFS_INODE_SLICED	0x1
+/* directory indexed by name hash, index_block is the root of the index */
+#define OUICHEFS_INODE_INDEXED	0x2
+/* O_TMPFILE inode not linked in any directory yet */
+#define OUICHEFS_INODE_ORPHAN	0x4
+/* small file writes are atomic, see OUICHEFS_IOCTL_SET_ATOMIC */
+#define OUICHEFS_INODE_ATOMIC	0x8
+
+/*
+ * LKP impl. slice map entry describing a sliced block. The slice map holds one
+ * entry per block of the partition, so all the slices of a sliced block carry
+ * data. Entries of blocks that are not sliced are all zero: mkfs clears the
+ * slice map, and a block leaving sliced use gets its entry cleared. Slice
+ * hints rely on it, an empty slice_bitmap has no room.
+ */
 struct ouichefs_sliced_block_meta {
-	__le32 slice_bitmap;          // show if corresponding sliced block is free（1 = free, 0 = used）
+	__le64 slice_bitmap;          // show if corresponding slice is free（1 = free, 0 = used）
 	__le32 next_partial_block;    // point to next partial block index. 0 if there isn't any
-    // following 31 sliced blocks are for intent
+	__le32 reserved;
 };
 
+#define OUICHEFS_SMAP_PER_BLOCK(sb) \
+	((sb)->s_blocksize / sizeof(struct ouichefs_sliced_block_meta))
 
 struct ouichefs_inode_info {
-	uint32_t index_block; /* LKP impl: now for packed slice */
+	uint64_t index_block; /* LKP impl: now for packed slice */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
+	uint32_t i_slice_hint; /* Directories: sliced block of the last child */
+	struct ouichefs_usage i_usage; /* Directories: OUICHEFS_FEATURE_DIR_USAGE */
+	char i_data[OUICHEFS_INLINE_MAX + 1]; /* Inline data, NUL terminated */
+	struct list_head i_jlist; /* Dirty in the running transaction */
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
+static inline bool ouichefs_is_sliced(struct inode *inode)
+{
+	return container_of(inode, struct ouichefs_inode_info, vfs_inode)->i_flags &
+	       OUICHEFS_INODE_SLICED;
+}
+
+static inline bool ouichefs_is_indexed(struct inode *inode)
+{
+	return container_of(inode, struct ouichefs_inode_info, vfs_inode)->i_flags &
+	       OUICHEFS_INODE_INDEXED;
+}
+
+#define OUICHEFS_INODES_PER_BLOCK(sb) \
+	(((struct ouichefs_sb_info *)(sb)->s_fs_info)->inodes_per_block)
+
+/* Number of block pointers in a file index block */
+#define OUICHEFS_INDEX_ENTRIES(sb) ((sb)->s_blocksize >> 2)
+
+/*
+ * Free bits taken from a bitmap ahead of time by one CPU, handed out to the
+ * allocations running there without touching the shared bitmap.
+ */
+#define OUICHEFS_BITMAP_BATCH 16
+
+struct ouichefs_bitmap_cache {
+	spinlock_t lock;
+	uint32_t nr; /* Number of bits held */
+	uint32_t bits[OUICHEFS_BITMAP_BATCH];
+};
+
+/*
+ * In-memory copy of a free bitmap (bit set means free), loaded one bitmap
+ * block at a time on first use. Blocks are only ever written back from
+ * memory, so the on-disk copy of a block not loaded yet is up to date.
+ */
+struct ouichefs_bitmap {
+	struct super_block *sb;
+	unsigned long **maps; /* Bits of each bitmap block, NULL until loaded */
+	uint32_t first; /* First on-disk bitmap block */
+	uint32_t nr_blocks; /* Number of bitmap blocks */
+	uint32_t nr_bits; /* Number of inodes or blocks covered */
+	uint32_t dirty; /* Bit of the first bitmap block in bitmap_dirty */
+	uint32_t *nr_free; /* Free bits of each bitmap block once loaded */
+	unsigned long *avail; /* Bitmap blocks that may have free bits */
+	unsigned long *summary; /* Words of avail that are not zero */
+	struct ouichefs_bitmap_cache __percpu *cache; /* Used by CPU caches */
+};
 
 struct ouichefs_sb_info {
 	uint32_t magic; /* Magic number */
@@ -118,9 +270,38 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
-	uint32_t s_free_sliced_blocks; /* LKP impl */
+	uint32_t nr_smap_blocks; /* Number of slice map blocks */
+	uint32_t s_free_sliced_blocks; /* LKP impl: head of partial sliced blocks list */
+	uint32_t s_features; /* OUICHEFS_FEATURE_* flags */
+	uint32_t s_block_size; /* Block size in bytes */
+	uint32_t s_slice_size; /* Slice size in bytes */
+	uint32_t s_inode_size; /* On-disk inode size */
+	uint32_t s_journal_start; /* First block of the journal area */
+	uint32_t s_journal_blocks; /* Blocks of the journal area */
+	uint32_t s_nr_orphans; /* O_TMPFILE inodes neither linked nor freed */
+
+	struct ouichefs_bitmap ifree; /* In-memory free inodes bitmap */
+	struct ouichefs_bitmap bfree; /* In-memory free blocks bitmap */
+	unsigned long *bitmap_dirty; /* Bitmap blocks changed since last sync */
+	uint32_t dir_rotor; /* Inode bitmap block the next mkdir starts from */
+
+	uint32_t slices_per_block; /* s_block_size / s_slice_size */
+	uint64_t slice_bitmap_full; /* slice_bitmap of an unused sliced block */
+	uint32_t inodes_per_block; /* s_block_size / s_inode_size */
+	uint32_t inline_size; /* Size of the inline data area of inodes */
+	struct mutex slice_lock; /* Protects the slice map and the partial list */
+	struct workqueue_struct *wq; /* Readahead and block reclaim */
+	spinlock_t usage_lock; /* Protects the i_usage of directories */
+	spinlock_t bitmap_lock; /* Protects the free bitmaps and counters */
+	spinlock_t reclaim_lock; /* Protects reclaim_list */
+	struct list_head reclaim_list; /* Index blocks of unlinked files */
+	struct work_struct reclaim_work; /* Frees the blocks of reclaim_list */
+	unsigned int s_mount_opt; /* OUICHEFS_MOUNT_* flags */
+	struct ouichefs_journal *journal; /* NULL without FEATURE_JOURNAL */
+	struct mutex flush_mutex; /* Serializes device cache flushes */
+	uint64_t flush_started; /* Id of the last flush started */
+	uint64_t flush_done; /* Id of the last flush completed */
+	int flush_err; /* Result of the last flush completed */
 
 	//add new variables for task 1.4
 	uint32_t sliced_blocks;
@@ -134,25 +315,226 @@ struct ouichefs_sb_info {
 	struct kobject sysfs_kobj;
 };
 
+/* Discard the blocks of unlinked files before reusing them */
+#define OUICHEFS_MOUNT_DISCARD		0x1
+
+/* 64-bit slice pointers, sliced blocks can live anywhere on the partition */
+#define OUICHEFS_FEATURE_SLICE64	0x1
+/* Directories keep the usage of their entries in their inline data area */
+#define OUICHEFS_FEATURE_DIR_USAGE	0x2
+/* Metadata changes are logged to the journal area before going home */
+#define OUICHEFS_FEATURE_JOURNAL	0x4
+#define OUICHEFS_FEATURE_ALL \
+	(OUICHEFS_FEATURE_SLICE64 | OUICHEFS_FEATURE_DIR_USAGE | \
+	 OUICHEFS_FEATURE_JOURNAL)
+
+/*
+ * The journal area is split in two halves used in turn by successive
+ * commits. Each half starts with a descriptor, followed by the copies of the
+ * logged blocks in the order of blocks[].
+ */
+#define OUICHEFS_JOURNAL_MAGIC 0x4a434957
+
+struct ouichefs_journal_desc {
+	__le32 magic;
+	__le32 nr; /* Number of logged blocks */
+	__le64 seq; /* Commit sequence number, the highest valid one wins */
+	__le32 csum; /* crc32c of the logged blocks, then of this block */
+	__le32 blocks[]; /* Home location of the logged blocks */
+};
+
+/* In-memory journal, see the metadata journal comment in super.c */
+struct ouichefs_journal {
+	struct super_block *sb;
+	uint32_t start; /* First block of the journal area */
+	uint32_t half; /* Blocks of each half of the area */
+	uint32_t capacity; /* Blocks a commit can log */
+	uint32_t max_bufs; /* capacity minus room for the commit itself */
+	unsigned int next; /* Half the next commit goes to */
+	uint64_t seq; /* Sequence number of the next commit */
+	struct rw_semaphore barrier; /* Read by operations, written by commits */
+	struct mutex commit_mutex; /* Serializes commits */
+	spinlock_t lock; /* Protects the running transaction */
+	uint64_t tid; /* Id of the running transaction */
+	uint64_t committed; /* Id of the last committed transaction */
+	struct buffer_head **bhs; /* Buffers of the running transaction */
+	uint32_t nr;
+	struct buffer_head **cbhs; /* Buffers of the committing transaction */
+	uint32_t cnr;
+	struct buffer_head **jbhs; /* Their copies in the journal area */
+	struct list_head inodes; /* Inodes of the running transaction */
+	uint32_t nr_inodes;
+	uint32_t reserved; /* Blocks reserved by the operations in flight */
+	wait_queue_head_t wait; /* Operations waiting for room */
+	struct xarray freed[2]; /* Blocks freed, kept until their commit ends */
+	struct list_head freed_slices[2]; /* Same for slice runs */
+	unsigned int fidx; /* Index in freed of the running transaction */
+	struct delayed_work commit_work; /* Commits every few seconds */
+	int err; /* Last commit error */
+	int aborted; /* Error that stopped the journal, nothing is written since */
+};
+
+/* On-disk struct ouichefs_usage, at the start of i_data of directories */
+struct ouichefs_disk_usage {
+	__le64 bytes;
+	__le64 slices;
+	__le64 blocks;
+	__le64 files;
+} __packed; /* i_data is only 4-byte aligned */
+
+/* Return the on-disk inode ino from bh, its inode store block */
+static inline struct ouichefs_inode *
+ouichefs_disk_inode(struct super_block *sb, struct buffer_head *bh,
+		    unsigned long ino)
+{
+	struct ouichefs_sb_info *sbi = sb->s_fs_info;
+
+	return (struct ouichefs_inode *)(bh->b_data +
+		(ino % sbi->inodes_per_block) * sbi->s_inode_size);
+}
+
+/* Decode the index of an on-disk inode */
+static inline uint64_t ouichefs_get_disk_index(struct ouichefs_sb_info *sbi,
+					       struct ouichefs_inode *disk_inode)
+{
+	uint32_t lo = le32_to_cpu(disk_inode->index_block);
+
+	if (!(le32_to_cpu(disk_inode->i_flags) & OUICHEFS_INODE_SLICED))
+		return lo;
+	if (sbi->s_features & OUICHEFS_FEATURE_SLICE64)
+		return ((uint64_t)le32_to_cpu(disk_inode->index_hi) << 32) | lo;
+	return unpack_slice_ptr32(lo);
+}
+
+/* Encode index, disk_inode->i_flags must be up to date */
+static inline void ouichefs_set_disk_index(struct ouichefs_sb_info *sbi,
+					   struct ouichefs_inode *disk_inode,
+					   uint64_t index)
+{
+	uint32_t lo = index, hi = 0;
+
+	if ((le32_to_cpu(disk_inode->i_flags) & OUICHEFS_INODE_SLICED) &&
+	    !(sbi->s_features & OUICHEFS_FEATURE_SLICE64)) {
+		lo = pack_slice_ptr32(extract_block_num(index),
+				      extract_slice_num(index));
+	} else {
+		hi = index >> 32;
+	}
+	disk_inode->index_block = cpu_to_le32(lo);
+	disk_inode->index_hi = cpu_to_le32(hi);
+}
+
+/* OUICHEFS_INDEX_ENTRIES(sb) pointers, as many as a block can hold */
 struct ouichefs_file_index_block {
-	__le32 blocks[OUICHEFS_BLOCK_SIZE >> 2];
+	__le32 blocks[0];
+};
+
+/*
+ * A directory is an array of ouichefs_file, the used entries first. Empty
+ * directories own no storage. Small ones live in a run of slices like small
+ * files (index_block is a slice pointer, i_size the size of the run), the run
+ * doubles as entries are added until it would fill half a block, then the
+ * directory moves to a block of its own.
+ */
+struct ouichefs_file {
+	__le32 inode;
+	char filename[OUICHEFS_FILENAME_LEN]; /* not NUL terminated when full */
+};
+
+/* Number of entries in a directory block */
+#define OUICHEFS_DIR_BLOCK_ENTRIES(sb) \
+	((sb)->s_blocksize / sizeof(struct ouichefs_file))
+
+/*
+ * Directories that outgrow their block are indexed by name hash. The root
+ * block (index_block) and, below it, at most one level of interior blocks hold
+ * (hash, block) pairs sorted by hash, the first pair of a node covering all
+ * hashes below the second one. Leaf blocks hold the entries of a hash range,
+ * unsorted, with a tag (low byte of the hash) per entry so that most names are
+ * rejected without a string compare. Names with the same hash always share a
+ * leaf.
+ */
+struct ouichefs_dx_entry {
+	__le32 hash; /* Lowest hash found below this entry */
+	__le32 block;
+};
+
+struct ouichefs_dx_node {
+	__le16 count; /* Used entries */
+	__u8 levels; /* Root only: levels of interior nodes below the root */
+	__u8 reserved;
+	__le32 nr_files; /* Root only: entries in the directory */
+	struct ouichefs_dx_entry entries[];
 };
 
-struct ouichefs_dir_block {
-	struct ouichefs_file {
-		__le32 inode;
-		char filename[OUICHEFS_FILENAME_LEN];
-	} files[OUICHEFS_MAX_SUBFILES];
+/* Levels of index nodes, root included */
+#define OUICHEFS_DX_MAX_LEVELS 2
+
+struct ouichefs_dx_leaf {
+	__le32 nr; /* Used entries, packed at the beginning */
+	__u8 tags[]; /* Followed by the entries, see ouichefs_dx_leaf_files() */
 };
 
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
+int ouichefs_trim_fs(struct super_block *sb, struct fstrim_range __user *arg);
+bool ouichefs_journal_start(struct super_block *sb);
+void ouichefs_journal_stop(struct super_block *sb, bool started);
+void ouichefs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+bool ouichefs_journal_trystart(struct super_block *sb);
+bool ouichefs_journal_pin(struct ouichefs_sb_info *sbi, uint32_t bno);
+bool ouichefs_journal_pin_slices(struct super_block *sb, uint32_t block_no,
+				 uint64_t mask, uint32_t nr);
+void ouichefs_reclaim_pending(struct ouichefs_sb_info *sbi);
+int ouichefs_journal_force(struct super_block *sb);
+bool ouichefs_journal_retry_alloc(struct super_block *sb, int *retries);
+void ouichefs_orphan_add(struct super_block *sb);
+void ouichefs_orphan_del(struct super_block *sb);
+uint64_t ouichefs_flush_ticket(struct super_block *sb);
+int ouichefs_flush_device(struct super_block *sb, uint64_t ticket);
+unsigned long *ouichefs_bitmap_load(struct ouichefs_bitmap *bm, uint32_t idx);
+uint32_t ouichefs_bitmap_alloc(struct ouichefs_sb_info *sbi,
+			       struct ouichefs_bitmap *bm, uint32_t *nr_free,
+			       uint32_t limit);
+void ouichefs_bitmap_put(struct ouichefs_sb_info *sbi,
+			 struct ouichefs_bitmap *bm, uint32_t *nr_free,
+			 uint32_t bit);
+uint32_t ouichefs_bitmap_alloc_range(struct ouichefs_sb_info *sbi,
+				     struct ouichefs_bitmap *bm,
+				     uint32_t *nr_free, uint32_t start,
+				     uint32_t end, uint32_t run);
+uint32_t ouichefs_bitmap_get(struct ouichefs_sb_info *sbi,
+			     struct ouichefs_bitmap *bm, uint32_t *nr_free);
+uint32_t ouichefs_bitmap_get_near(struct ouichefs_sb_info *sbi,
+				  struct ouichefs_bitmap *bm, uint32_t start,
+				  uint32_t end);
+void ouichefs_bitmap_drain(struct ouichefs_sb_info *sbi,
+			   struct ouichefs_bitmap *bm, uint32_t *nr_free);
+bool ouichefs_bitmap_has_free(struct ouichefs_bitmap *bm, uint32_t *nr_free,
+			      uint64_t n);
+uint32_t ouichefs_bitmap_count_free(struct ouichefs_bitmap *bm,
+				    uint32_t *nr_free);
+void ouichefs_discard_blocks(struct super_block *sb, uint32_t *blocks, int nr);
 
 /* inode functions */
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
 
+/* directory functions */
+int ouichefs_find_entry(struct inode *dir, const struct qstr *name,
+			uint32_t *ino);
+int ouichefs_add_entry(struct inode *dir, const struct qstr *name,
+		       uint32_t ino);
+int ouichefs_remove_entry(struct inode *dir, const struct qstr *name);
+int ouichefs_set_entry(struct inode *dir, const struct qstr *name,
+		       uint32_t ino);
+int ouichefs_dir_is_empty(struct inode *dir);
+int ouichefs_cmp_u32(const void *a, const void *b);
+int ouichefs_dir_entries(struct inode *dir, struct ouichefs_file **files,
+			 uint32_t *nr);
+void ouichefs_release_dir(struct inode *dir);
+
 /* file functions */
 extern const struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
@@ -160,9 +542,60 @@ extern const struct address_space_operations ouichefs_aops;
 
 uint32_t ouichefs_alloc_block(struct super_block *sb); //new function added for task1.5
 
+/* slice map functions */
+struct ouichefs_sliced_block_meta *
+ouichefs_get_slice_meta(struct super_block *sb, uint32_t block_no,
+			struct buffer_head **bhp);
+int ouichefs_alloc_slices(struct super_block *sb, uint32_t num_slices,
+			  uint32_t hint, uint32_t *block_no,
+			  uint32_t *slice_start);
+void ouichefs_free_slices(struct super_block *sb, uint32_t block_no,
+			  uint32_t slice_no, uint32_t num_slices);
+void __ouichefs_free_slices(struct super_block *sb, uint32_t block_no,
+			    uint64_t mask, uint32_t num_slices);
+
+/*
+ * Slices of a sliced block, freed and kept by the journal until committed, or
+ * given back with ouichefs_free_slice_runs()
+ */
+struct ouichefs_slice_run {
+	struct list_head list;
+	uint32_t block;
+	uint32_t nr;
+	uint64_t mask;
+};
+
+void ouichefs_free_slice_runs(struct super_block *sb,
+			      struct ouichefs_slice_run *runs, uint32_t nr);
+
 /* Getters for superbock and inode */
 #define OUICHEFS_SB(sb) (sb->s_fs_info)
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
+static inline bool ouichefs_journaled(struct super_block *sb)
+{
+	return ((struct ouichefs_sb_info *)sb->s_fs_info)->journal;
+}
+
+/*
+ * Sliced block where the small children of dir are placed first, so that the
+ * files of a directory share a few blocks. Starts with the block holding dir.
+ * Only a hint: the allocator checks that the block still has room.
+ */
+static inline uint32_t ouichefs_slice_hint(struct inode *dir)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(dir);
+	uint32_t hint = READ_ONCE(ci->i_slice_hint);
+
+	if (!hint && ouichefs_is_sliced(dir))
+		hint = extract_block_num(ci->index_block);
+	return hint;
+}
+
+static inline void ouichefs_set_slice_hint(struct inode *dir, uint32_t bno)
+{
+	WRITE_ONCE(OUICHEFS_INODE(dir)->i_slice_hint, bno);
+}
+
 #endif /* _OUICHEFS_H */
@@ -12,6 +12,14 @@
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/blkdev.h>
+#include <linux/sort.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/crc32c.h>
+#include <linux/xarray.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
@@ -45,6 +53,7 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	INIT_LIST_HEAD(&ci->i_jlist);
 	return &ci->vfs_inode;
 }
 
@@ -56,8 +65,11 @@ static void ouichefs_destroy_inode(struct inode *inode)
 	kmem_cache_free(ouichefs_inode_cache, ci);
 }
 
-static int ouichefs_write_inode(struct inode *inode,
-				struct writeback_control *wbc)
+/*
+ * Copy inode to its inode store block and return the buffer, NULL if inode has
+ * no slot in the inode store.
+ */
+static struct buffer_head *ouichefs_copy_inode(struct inode *inode)
 {
 	struct ouichefs_inode *disk_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
@@ -65,17 +77,15 @@ static int ouichefs_write_inode(struct inode *inode,
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
 	uint32_t ino = inode->i_ino;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK(sb)) + 1;
 
 	if (ino >= sbi->nr_inodes)
-		return 0;
+		return NULL;
 
 	bh = sb_bread(sb, inode_block);
 	if (!bh)
-		return -EIO;
-	disk_inode = (struct ouichefs_inode *)bh->b_data;
-	disk_inode += inode_shift;
+		return ERR_PTR(-EIO);
+	disk_inode = ouichefs_disk_inode(sb, bh, ino);
 
 	/* update the mode using what the generic inode has */
 	disk_inode->i_mode = cpu_to_le32(inode->i_mode);
@@ -90,122 +100,1738 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_nmtime = cpu_to_le64(inode->i_mtime.tv_nsec);
 	disk_inode->i_blocks = cpu_to_le32(inode->i_blocks);
 	disk_inode->i_nlink = cpu_to_le32(inode->i_nlink);
-	disk_inode->index_block = cpu_to_le32(ci->index_block);
+	disk_inode->i_flags = cpu_to_le32(ci->i_flags);
+	ouichefs_set_disk_index(sbi, disk_inode, ci->index_block);
+	memcpy(disk_inode->i_data, ci->i_data, sbi->inline_size);
+	if (S_ISDIR(inode->i_mode) &&
+	    (sbi->s_features & OUICHEFS_FEATURE_DIR_USAGE)) {
+		struct ouichefs_disk_usage *du = (void *)disk_inode->i_data;
+
+		spin_lock(&sbi->usage_lock);
+		du->bytes = cpu_to_le64(ci->i_usage.bytes);
+		du->slices = cpu_to_le64(ci->i_usage.slices);
+		du->blocks = cpu_to_le64(ci->i_usage.blocks);
+		du->files = cpu_to_le64(ci->i_usage.files);
+		spin_unlock(&sbi->usage_lock);
+	}
+
+	return bh;
+}
+
+static int ouichefs_write_inode(struct inode *inode,
+				struct writeback_control *wbc)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	/* The next commit logs the inode, see ouichefs_dirty_inode() */
+	if (ouichefs_journaled(sb)) {
+		if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync)
+			return ouichefs_journal_force(sb);
+		return 0;
+	}
+
+	bh = ouichefs_copy_inode(inode);
+	if (IS_ERR_OR_NULL(bh))
+		return PTR_ERR_OR_ZERO(bh);
+
+	/*
+	 * Inodes share inode store blocks, leave the block dirty for the
+	 * writeback of the block device unless the caller needs the inode on
+	 * disk. sync(2) writes the whole block device after sync_fs, so each
+	 * inode store block is written once however many inodes it holds.
+	 */
+	mark_buffer_dirty(bh);
+	if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync) {
+		sync_dirty_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh))
+			ret = -EIO;
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/*
+ * Metadata blocks written by sync_fs. With wait, writes are submitted as
+ * they come under the plug of ouichefs_sync_fs() and waited for by batches,
+ * so that adjacent bitmap blocks are merged into few requests. With j, the
+ * blocks are added to the transaction being committed instead.
+ */
+#define OUICHEFS_SYNC_BATCH 16
+
+struct ouichefs_sync {
+	struct buffer_head *bhs[OUICHEFS_SYNC_BATCH];
+	int nr;
+	int ret;
+	struct ouichefs_journal *j;
+};
+
+static void sync_wait(struct ouichefs_sync *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr; i++) {
+		wait_on_buffer(s->bhs[i]);
+		if (!buffer_uptodate(s->bhs[i]))
+			s->ret = -EIO;
+		brelse(s->bhs[i]);
+	}
+	s->nr = 0;
+}
+
+/* Mark bh dirty and, if s is not NULL, start writing it. Consumes bh. */
+static void sync_buffer(struct ouichefs_sync *s, struct buffer_head *bh)
+{
+	if (s && s->j) {
+		/* Never written home unlogged, the commit fails instead */
+		if (s->j->cnr < s->j->capacity) {
+			s->j->cbhs[s->j->cnr++] = bh;
+		} else {
+			s->ret = -ENOSPC;
+			brelse(bh);
+		}
+		return;
+	}
+
+	mark_buffer_dirty(bh);
+	if (!s) {
+		brelse(bh);
+		return;
+	}
+	write_dirty_buffer(bh, REQ_SYNC);
+	s->bhs[s->nr++] = bh;
+	if (s->nr == OUICHEFS_SYNC_BATCH)
+		sync_wait(s);
+}
+
+static int sync_sb_info(struct super_block *sb, struct ouichefs_sync *s)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sb_info *disk_sb;
+	struct buffer_head *bh;
+
+	/* Flush superblock */
+	bh = sb_bread(sb, 0);
+	if (!bh)
+		return -EIO;
+	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+
+	disk_sb->nr_blocks = cpu_to_le32(sbi->nr_blocks);
+	disk_sb->nr_inodes = cpu_to_le32(sbi->nr_inodes);
+	disk_sb->nr_istore_blocks = cpu_to_le32(sbi->nr_istore_blocks);
+	disk_sb->nr_ifree_blocks = cpu_to_le32(sbi->nr_ifree_blocks);
+	disk_sb->nr_bfree_blocks = cpu_to_le32(sbi->nr_bfree_blocks);
+	/* Bits held by CPU caches are free on disk, see sync_bitmap() */
+	disk_sb->nr_free_inodes = cpu_to_le32(count_free_inodes(sbi));
+	disk_sb->nr_free_blocks = cpu_to_le32(count_free_blocks(sbi));
+	disk_sb->nr_smap_blocks = cpu_to_le32(sbi->nr_smap_blocks);
+	disk_sb->s_free_sliced_blocks = cpu_to_le32(sbi->s_free_sliced_blocks);
+	disk_sb->s_features = cpu_to_le32(sbi->s_features);
+	disk_sb->s_block_size = cpu_to_le32(sbi->s_block_size);
+	disk_sb->s_slice_size = cpu_to_le32(sbi->s_slice_size);
+	disk_sb->s_inode_size = cpu_to_le32(sbi->s_inode_size);
+	disk_sb->s_journal_start = cpu_to_le32(sbi->s_journal_start);
+	disk_sb->s_journal_blocks = cpu_to_le32(sbi->s_journal_blocks);
+	disk_sb->s_nr_orphans = cpu_to_le32(sbi->s_nr_orphans);
+
+	sync_buffer(s, bh);
+
+	return 0;
+}
+
+/*
+ * Mark the bits of bitmap block idx held by CPU caches free in data, the
+ * on-disk copy of the block. Nothing uses them yet, and a crash would leak
+ * them otherwise. Handing one out marks the block dirty again. Called with
+ * bitmap_lock held.
+ */
+static void sync_bitmap_cached(struct super_block *sb,
+			       struct ouichefs_bitmap *bm, uint32_t idx,
+			       __le64 *data)
+{
+	uint32_t per_block = sb->s_blocksize * BITS_PER_BYTE, bit, i;
+	struct ouichefs_bitmap_cache *c;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(bm->cache, cpu);
+		spin_lock(&c->lock);
+		for (i = 0; i < c->nr; i++) {
+			if (c->bits[i] / per_block != idx)
+				continue;
+			bit = c->bits[i] % per_block;
+			data[bit / 64] |= cpu_to_le64(1ULL << (bit % 64));
+		}
+		spin_unlock(&c->lock);
+	}
+}
+
+/* Write the blocks of bm whose dirty bit is set, only loaded ones can be */
+static int sync_bitmap(struct super_block *sb, struct ouichefs_sync *s,
+		       struct ouichefs_bitmap *bm)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t end = bm->dirty + bm->nr_blocks;
+	struct buffer_head *bh;
+	uint32_t i;
+
+	for (i = find_next_bit(sbi->bitmap_dirty, end, bm->dirty); i < end;
+	     i = find_next_bit(sbi->bitmap_dirty, end, i + 1)) {
+		bh = sb_bread(sb, bm->first + i - bm->dirty);
+		if (!bh)
+			return -EIO;
+
+		/* Changes made after the copy set the dirty bit again */
+		spin_lock(&sbi->bitmap_lock);
+		clear_bit(i, sbi->bitmap_dirty);
+		copy_bitmap_to_le64((__le64 *)bh->b_data,
+				    bm->maps[i - bm->dirty], sb->s_blocksize);
+		sync_bitmap_cached(sb, bm, i - bm->dirty,
+				   (__le64 *)bh->b_data);
+		spin_unlock(&sbi->bitmap_lock);
+
+		sync_buffer(s, bh);
+	}
+
+	return 0;
+}
+
+static int sync_ifree(struct super_block *sb, struct ouichefs_sync *s)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	/* Flush free inodes bitmask */
+	return sync_bitmap(sb, s, &sbi->ifree);
+}
+
+static int sync_bfree(struct super_block *sb, struct ouichefs_sync *s)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	/* Flush free blocks bitmask */
+	return sync_bitmap(sb, s, &sbi->bfree);
+}
+
+/*
+ * Free bitmaps are not read at mount: each bitmap block is read the first
+ * time an allocation reaches it or something is freed in it, along with a few
+ * of the next ones. Memory thus grows with the part of the partition used.
+ *
+ * Each bitmap block is a group with its own free count. Above them, avail has
+ * a bit per group that may still have free bits, unloaded groups included,
+ * and summary a bit per non-zero word of avail. Allocation goes through both
+ * to the first group with free bits instead of scanning full ones.
+ */
+#define OUICHEFS_BITMAP_RA 8
+
+/* Group idx of bm may have free bits again. Called with bitmap_lock held. */
+static void ouichefs_bitmap_set_avail(struct ouichefs_bitmap *bm, uint32_t idx)
+{
+	__set_bit(idx, bm->avail);
+	__set_bit(idx / BITS_PER_LONG, bm->summary);
+}
+
+/* Group idx of bm is full. Called with bitmap_lock held. */
+static void ouichefs_bitmap_clear_avail(struct ouichefs_bitmap *bm,
+					uint32_t idx)
+{
+	__clear_bit(idx, bm->avail);
+	if (!bm->avail[idx / BITS_PER_LONG])
+		__clear_bit(idx / BITS_PER_LONG, bm->summary);
+}
+
+/*
+ * Return the first group of bm from from on that may have free bits, or end
+ * if there is none below end. Called with bitmap_lock held.
+ */
+static uint32_t ouichefs_bitmap_next_avail(struct ouichefs_bitmap *bm,
+					   uint32_t from, uint32_t end)
+{
+	uint32_t nr_words = BITS_TO_LONGS(bm->nr_blocks);
+	uint32_t w = from / BITS_PER_LONG;
+	unsigned long word;
+
+	if (from >= end)
+		return end;
+	word = bm->avail[w] & BITMAP_FIRST_WORD_MASK(from);
+	if (!word) {
+		w = find_next_bit(bm->summary, nr_words, w + 1);
+		if (w >= nr_words)
+			return end;
+		word = bm->avail[w];
+	}
+
+	return min_t(uint32_t, w * BITS_PER_LONG + __ffs(word), end);
+}
+
+static void ouichefs_bitmap_destroy(struct ouichefs_bitmap *bm)
+{
+	uint32_t i;
+
+	if (bm->maps) {
+		for (i = 0; i < bm->nr_blocks; i++)
+			kfree(bm->maps[i]);
+	}
+	kvfree(bm->maps);
+	kvfree(bm->nr_free);
+	bitmap_free(bm->avail);
+	bitmap_free(bm->summary);
+	free_percpu(bm->cache);
+}
+
+static int ouichefs_bitmap_init(struct super_block *sb,
+				struct ouichefs_bitmap *bm, uint32_t first,
+				uint32_t nr_blocks, uint32_t nr_bits,
+				uint32_t dirty)
+{
+	int cpu;
+
+	if ((uint64_t)nr_blocks * sb->s_blocksize * BITS_PER_BYTE < nr_bits) {
+		pr_err("Bitmap of %u blocks too small for %u bits\n", nr_blocks,
+		       nr_bits);
+		return -EINVAL;
+	}
+	bm->sb = sb;
+	bm->first = first;
+	bm->nr_blocks = nr_blocks;
+	bm->nr_bits = nr_bits;
+	bm->dirty = dirty;
+	bm->maps = kvcalloc(nr_blocks, sizeof(*bm->maps), GFP_KERNEL);
+	bm->nr_free = kvcalloc(nr_blocks, sizeof(*bm->nr_free), GFP_KERNEL);
+	bm->avail = bitmap_zalloc(nr_blocks, GFP_KERNEL);
+	bm->summary = bitmap_zalloc(BITS_TO_LONGS(nr_blocks), GFP_KERNEL);
+	bm->cache = alloc_percpu(struct ouichefs_bitmap_cache);
+	if (!bm->maps || !bm->nr_free || !bm->avail || !bm->summary ||
+	    !bm->cache) {
+		ouichefs_bitmap_destroy(bm);
+		return -ENOMEM;
+	}
+
+	/* Nothing is known about unloaded groups, they may all have room */
+	bitmap_set(bm->avail, 0, nr_blocks);
+	bitmap_set(bm->summary, 0, BITS_TO_LONGS(nr_blocks));
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(bm->cache, cpu)->lock);
+
+	return 0;
+}
+
+/*
+ * Return the in-memory copy of bitmap block idx of bm, reading it on first
+ * use, or NULL if it cannot be read. May sleep.
+ */
+unsigned long *ouichefs_bitmap_load(struct ouichefs_bitmap *bm, uint32_t idx)
+{
+	struct super_block *sb = bm->sb;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t bits = sb->s_blocksize * BITS_PER_BYTE;
+	struct buffer_head *bh;
+	unsigned long *map;
+	uint32_t i, nr_free;
+
+	map = smp_load_acquire(&bm->maps[idx]);
+	if (map)
+		return map;
+
+	/* Allocations walk the bitmap in order, the next blocks come soon */
+	for (i = idx + 1; i < bm->nr_blocks && i <= idx + OUICHEFS_BITMAP_RA;
+	     i++) {
+		if (!READ_ONCE(bm->maps[i]))
+			sb_breadahead(sb, bm->first + i);
+	}
+
+	bh = sb_bread(sb, bm->first + idx);
+	if (!bh)
+		return NULL;
+	map = kmalloc(sb->s_blocksize, GFP_NOFS);
+	if (map)
+		copy_bitmap_from_le64(map, (__le64 *)bh->b_data,
+				      sb->s_blocksize);
+	brelse(bh);
+	if (!map)
+		return NULL;
+
+	/* Bits past the end of the last block do not stand for anything */
+	if ((uint64_t)(idx + 1) * bits > bm->nr_bits)
+		bitmap_clear(map, bm->nr_bits - idx * bits,
+			     (idx + 1) * bits - bm->nr_bits);
+	nr_free = bitmap_weight(map, bits);
+
+	/* Somebody may have loaded it meanwhile */
+	spin_lock(&sbi->bitmap_lock);
+	if (bm->maps[idx]) {
+		kfree(map);
+		map = bm->maps[idx];
+	} else {
+		bm->nr_free[idx] = nr_free;
+		if (!nr_free)
+			ouichefs_bitmap_clear_avail(bm, idx);
+		smp_store_release(&bm->maps[idx], map);
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return map;
+}
+
+/*
+ * Take up to n free bits of bm below limit, first ones first, into bits and
+ * decrement *nr_free accordingly. Return how many were taken. Bit 0 is never
+ * free, the superblock and the root inode use it. May sleep to load bitmap
+ * blocks.
+ */
+static uint32_t ouichefs_bitmap_take(struct ouichefs_sb_info *sbi,
+				     struct ouichefs_bitmap *bm,
+				     uint32_t *nr_free, uint32_t limit,
+				     uint32_t *bits, uint32_t n)
+{
+	uint32_t per_block = sbi->s_block_size * BITS_PER_BYTE;
+	uint32_t end = DIV_ROUND_UP(limit, per_block);
+	uint32_t idx = 0, size, bit, got = 0;
+	unsigned long *map;
+
+	while (got < n) {
+		/* Do not load the whole bitmap to find nothing */
+		if (!READ_ONCE(*nr_free))
+			break;
+		spin_lock(&sbi->bitmap_lock);
+		idx = ouichefs_bitmap_next_avail(bm, idx, end);
+		spin_unlock(&sbi->bitmap_lock);
+		if (idx >= end)
+			break;
+
+		map = ouichefs_bitmap_load(bm, idx);
+		if (!map) {
+			idx++;
+			continue;
+		}
+		size = min_t(uint64_t, per_block,
+			     limit - (uint64_t)idx * per_block);
+
+		spin_lock(&sbi->bitmap_lock);
+		bit = bm->nr_free[idx] ? find_first_bit(map, size) : size;
+		while (bit < size && got < n) {
+			__clear_bit(bit, map);
+			(*nr_free)--;
+			if (!--bm->nr_free[idx])
+				ouichefs_bitmap_clear_avail(bm, idx);
+			bits[got++] = idx * per_block + bit;
+			bit = find_next_bit(map, size, bit + 1);
+		}
+		if (got)
+			mark_bitmap_dirty(sbi, bm, idx * per_block);
+		spin_unlock(&sbi->bitmap_lock);
+		idx++;
+	}
+
+	return got;
+}
+
+/*
+ * Take the first free bit of bm below limit and decrement *nr_free, return 0
+ * if there is none. May sleep.
+ */
+uint32_t ouichefs_bitmap_alloc(struct ouichefs_sb_info *sbi,
+			       struct ouichefs_bitmap *bm, uint32_t *nr_free,
+			       uint32_t limit)
+{
+	uint32_t bit;
+
+	if (!ouichefs_bitmap_take(sbi, bm, nr_free, limit, &bit, 1))
+		return 0;
+	return bit;
+}
+
+/*
+ * Take the first free bit of bm in [start, end) that begins a run of run free
+ * bits aligned on run, and decrement *nr_free. Only the bitmap block of start
+ * is searched. Return 0 if there is no such bit, or if bitmap_lock is taken:
+ * callers then fall back to their CPU cache rather than wait for a spot of
+ * their choice. May sleep.
+ */
+uint32_t ouichefs_bitmap_alloc_range(struct ouichefs_sb_info *sbi,
+				     struct ouichefs_bitmap *bm,
+				     uint32_t *nr_free, uint32_t start,
+				     uint32_t end, uint32_t run)
+{
+	uint32_t per_block = sbi->s_block_size * BITS_PER_BYTE;
+	uint32_t idx = start / per_block, base = idx * per_block;
+	uint32_t bit, zero;
+	unsigned long *map;
+
+	end = min3(end, base + per_block, bm->nr_bits);
+	if (start >= end || !test_bit(idx, bm->avail))
+		return 0;
+	map = ouichefs_bitmap_load(bm, idx);
+	if (!map)
+		return 0;
+	start -= base;
+	end -= base;
+
+	if (!spin_trylock(&sbi->bitmap_lock))
+		return 0;
+	for (bit = find_next_bit(map, end, start); bit < end;
+	     bit = find_next_bit(map, end, bit)) {
+		if (run == 1)
+			break;
+		/* Move to the next aligned run and check it is all free */
+		bit = roundup(base + bit, run) - base;
+		if (bit + run > end) {
+			bit = end;
+			break;
+		}
+		zero = find_next_zero_bit(map, bit + run, bit);
+		if (zero >= bit + run)
+			break;
+		bit = zero;
+	}
+	if (bit < end) {
+		__clear_bit(bit, map);
+		(*nr_free)--;
+		if (!--bm->nr_free[idx])
+			ouichefs_bitmap_clear_avail(bm, idx);
+		bit += base;
+		mark_bitmap_dirty(sbi, bm, bit);
+	} else {
+		bit = 0;
+	}
+	spin_unlock(&sbi->bitmap_lock);
+
+	return bit;
+}
+
+/*
+ * Take a free bit of bm from the cache of the current CPU, return 0 if there
+ * is none left anywhere. An empty cache is refilled with a batch of bits from
+ * the shared bitmap, so allocations on different CPUs seldom meet on
+ * bitmap_lock and *nr_free. May sleep.
+ */
+uint32_t ouichefs_bitmap_get(struct ouichefs_sb_info *sbi,
+			     struct ouichefs_bitmap *bm, uint32_t *nr_free)
+{
+	uint32_t bits[OUICHEFS_BITMAP_BATCH];
+	struct ouichefs_bitmap_cache *c;
+	bool drained = false;
+	uint32_t bit = 0, n, i;
+
+again:
+	/* Migrating meanwhile is fine, the lock is what protects the cache */
+	c = raw_cpu_ptr(bm->cache);
+	spin_lock(&c->lock);
+	if (c->nr)
+		bit = c->bits[--c->nr];
+	spin_unlock(&c->lock);
+	if (bit) {
+		/* Synced bitmap blocks show cached bits as free */
+		mark_bitmap_dirty(sbi, bm, bit);
+		return bit;
+	}
+
+	n = ouichefs_bitmap_take(sbi, bm, nr_free, bm->nr_bits, bits,
+				 OUICHEFS_BITMAP_BATCH);
+	if (!n) {
+		/* The last free bits may sit in the caches of other CPUs */
+		if (drained)
+			return 0;
+		ouichefs_bitmap_drain(sbi, bm, nr_free);
+		drained = true;
+		goto again;
+	}
+
+	/* Keep the rest, lowest on top, unless somebody refilled meanwhile */
+	c = raw_cpu_ptr(bm->cache);
+	spin_lock(&c->lock);
+	for (i = n; i > 1 && c->nr < OUICHEFS_BITMAP_BATCH; i--)
+		c->bits[c->nr++] = bits[i - 1];
+	spin_unlock(&c->lock);
+	while (i > 1)
+		ouichefs_bitmap_put(sbi, bm, nr_free, bits[--i]);
+
+	return bits[0];
+}
+
+/*
+ * Take a free bit of bm in [start, end) from the cache of the current CPU,
+ * return 0 if it holds none there. The shared bitmap is left alone.
+ */
+uint32_t ouichefs_bitmap_get_near(struct ouichefs_sb_info *sbi,
+				  struct ouichefs_bitmap *bm, uint32_t start,
+				  uint32_t end)
+{
+	struct ouichefs_bitmap_cache *c = raw_cpu_ptr(bm->cache);
+	uint32_t bit = 0, i;
+
+	spin_lock(&c->lock);
+	for (i = 0; i < c->nr; i++) {
+		if (c->bits[i] < start || c->bits[i] >= end)
+			continue;
+		bit = c->bits[i];
+		/* The others keep their order, lowest on top */
+		memmove(&c->bits[i], &c->bits[i + 1],
+			(c->nr - i - 1) * sizeof(*c->bits));
+		c->nr--;
+		break;
+	}
+	spin_unlock(&c->lock);
+	if (bit)
+		mark_bitmap_dirty(sbi, bm, bit);
+
+	return bit;
+}
+
+/*
+ * Give bit back to bm and increment *nr_free. Unless dirty, the on-disk bitmap
+ * has bit free already. May sleep.
+ */
+static void __ouichefs_bitmap_put(struct ouichefs_sb_info *sbi,
+				  struct ouichefs_bitmap *bm, uint32_t *nr_free,
+				  uint32_t bit, bool dirty)
+{
+	uint32_t bits = sbi->s_block_size * BITS_PER_BYTE;
+	unsigned long *map;
+
+	/* bit is greater than the bitmap size */
+	if (bit >= bm->nr_bits)
+		return;
+
+	map = ouichefs_bitmap_load(bm, bit / bits);
+	if (!map) {
+		pr_err("Bitmap block of %u unreadable, not freeing it\n", bit);
+		return;
+	}
+
+	spin_lock(&sbi->bitmap_lock);
+	if (!__test_and_set_bit(bit % bits, map)) {
+		(*nr_free)++;
+		if (!bm->nr_free[bit / bits]++)
+			ouichefs_bitmap_set_avail(bm, bit / bits);
+		if (dirty)
+			mark_bitmap_dirty(sbi, bm, bit);
+	}
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * Give the bits held in the caches of all CPUs back to bm, for the on-disk
+ * bitmap to be exact at unmount or when the shared bitmap runs out. May sleep.
+ */
+void ouichefs_bitmap_drain(struct ouichefs_sb_info *sbi,
+			   struct ouichefs_bitmap *bm, uint32_t *nr_free)
+{
+	uint32_t bits[OUICHEFS_BITMAP_BATCH];
+	struct ouichefs_bitmap_cache *c;
+	uint32_t n;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(bm->cache, cpu);
+		spin_lock(&c->lock);
+		n = c->nr;
+		memcpy(bits, c->bits, n * sizeof(*bits));
+		c->nr = 0;
+		spin_unlock(&c->lock);
+		/* Free on disk already, see sync_bitmap_cached() */
+		while (n)
+			__ouichefs_bitmap_put(sbi, bm, nr_free, bits[--n],
+					      false);
+	}
+}
+
+/*
+ * Whether at least n bits of bm are free, those held in CPU caches included.
+ * The caches are only looked at when the shared count alone falls short.
+ */
+bool ouichefs_bitmap_has_free(struct ouichefs_bitmap *bm, uint32_t *nr_free,
+			      uint64_t n)
+{
+	uint64_t free = READ_ONCE(*nr_free);
+	int cpu;
+
+	if (free >= n)
+		return true;
+	for_each_possible_cpu(cpu)
+		free += READ_ONCE(per_cpu_ptr(bm->cache, cpu)->nr);
+	return free >= n;
+}
+
+/* Number of free bits of bm, those held in CPU caches included */
+uint32_t ouichefs_bitmap_count_free(struct ouichefs_bitmap *bm,
+				    uint32_t *nr_free)
+{
+	uint32_t free = READ_ONCE(*nr_free);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		free += READ_ONCE(per_cpu_ptr(bm->cache, cpu)->nr);
+	return free;
+}
+
+/* Give bit back to bm and increment *nr_free. May sleep. */
+void ouichefs_bitmap_put(struct ouichefs_sb_info *sbi,
+			 struct ouichefs_bitmap *bm, uint32_t *nr_free,
+			 uint32_t bit)
+{
+	__ouichefs_bitmap_put(sbi, bm, nr_free, bit, true);
+}
+
+/*
+ * Device cache flushes are shared: a flush started after the writes of a
+ * caller completed makes them durable, whoever issued it. Callers take a
+ * ticket once their writes are done and only flush if no flush started after
+ * the ticket has completed meanwhile. Callers queued on flush_mutex behind a
+ * running flush are covered by the next one.
+ */
+uint64_t ouichefs_flush_ticket(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	return READ_ONCE(sbi->flush_started);
+}
+
+int ouichefs_flush_device(struct super_block *sb, uint64_t ticket)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int ret;
+
+	mutex_lock(&sbi->flush_mutex);
+	if (sbi->flush_done <= ticket) {
+		WRITE_ONCE(sbi->flush_started, sbi->flush_started + 1);
+		sbi->flush_err = blkdev_issue_flush(sb->s_bdev);
+		sbi->flush_done = sbi->flush_started;
+	}
+	ret = sbi->flush_err;
+	mutex_unlock(&sbi->flush_mutex);
+
+	return ret;
+}
+
+/*
+ * Metadata journal (OUICHEFS_FEATURE_JOURNAL)
+ *
+ * Metadata buffers changed by an operation are attached to the running
+ * transaction with ouichefs_journal_dirty() instead of being marked dirty, so
+ * that nothing reaches its home location before being logged. Inodes marked
+ * dirty join the transaction too and are copied to their inode store block at
+ * commit time, along with the superblock and the dirty bitmap blocks.
+ *
+ * A commit waits for the operations in flight, copies the blocks of the
+ * transaction to the next half of the journal area and lets new operations
+ * in. It then writes the copies, flushes the device cache, writes the
+ * descriptor with FUA, and finally the blocks at home, from the copies since
+ * the live buffers may already hold changes of the next transaction. Commits
+ * are serialized and wait for their home writes, so the previous transaction
+ * is on disk, flushed before the descriptor of the next one, by the time its
+ * half is reused. Callers waiting for a commit share it: whoever gets
+ * commit_mutex first commits the changes of everybody, so concurrent fsyncs
+ * cost one flush.
+ *
+ * Blocks freed by a transaction stay out of the bitmap until it is committed,
+ * and are neither logged nor written home by it. A freed metadata block can
+ * thus not be reused, say for file data, while the journal may still write an
+ * old copy of it home: once the freeing transaction is committed, its
+ * descriptor supersedes the one of any transaction that logged the block.
+ * Index blocks of unlinked files are reclaimed in the transaction of the
+ * unlink, the commit reclaims those the worker did not get to. Freed slices
+ * stay used in the slice map the same way, so that the previous content of a
+ * file or directory survives until the switch away from it is committed.
+ *
+ * Each operation reserves room in the running transaction for the blocks it
+ * may change when it starts, and waits for the operations in flight or for a
+ * commit when there is none left, so that a commit always fits in its half of
+ * the journal area. A commit that fails aborts the journal: nothing goes home
+ * unlogged, the partition stays as of the last commit and turns read-only.
+ *
+ * At mount, the valid descriptor with the highest sequence number is
+ * replayed. Data blocks of regular files are not logged, sliced blocks are:
+ * small files share them with directories and symlinks, and a checkpoint
+ * writes them whole.
+ */
+#define OUICHEFS_JOURNAL_INTERVAL (5 * HZ)
+
+/*
+ * Blocks an operation may change, inode store and bitmap blocks included: a
+ * rename between two hashed directories, over a sliced file.
+ */
+#define OUICHEFS_JOURNAL_CREDITS 20
+
+/* Private state bit of buffers attached to the running transaction */
+#define BH_OuichefsJournal BH_PrivateStart
+
+static struct ouichefs_journal *ouichefs_journal(struct super_block *sb)
+{
+	return ((struct ouichefs_sb_info *)sb->s_fs_info)->journal;
+}
+
+/* Blocks a commit can log with half blocks of journal area */
+static uint32_t ouichefs_journal_capacity(struct super_block *sb,
+					  uint32_t half)
+{
+	return min_t(uint32_t, half - 1,
+		     (sb->s_blocksize - sizeof(struct ouichefs_journal_desc)) /
+		     sizeof(__le32));
+}
+
+/* crc32c of a descriptor block, its csum field taken as zero */
+static u32 ouichefs_journal_csum(u32 crc, struct ouichefs_journal_desc *d,
+				 unsigned long size)
+{
+	size_t off = offsetof(struct ouichefs_journal_desc, csum);
+	__le32 zero = 0;
+
+	crc = crc32c(crc, d, off);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	return crc32c(crc, (void *)d + off + sizeof(zero),
+		      size - off - sizeof(zero));
+}
+
+/*
+ * Stop the journal after err: nothing is logged nor written home from now on,
+ * so the partition stays as of the last commit, which the next mount replays.
+ * Operations in flight end in memory only, new ones find it read-only.
+ */
+static void ouichefs_journal_abort(struct super_block *sb, int err)
+{
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+
+	spin_lock(&j->lock);
+	if (j->aborted) {
+		spin_unlock(&j->lock);
+		return;
+	}
+	j->aborted = err;
+	spin_unlock(&j->lock);
+
+	j->err = err;
+	sb->s_flags |= SB_RDONLY;
+	wake_up_all(&j->wait);
+	pr_err("%s: journal aborted (%d), remounted read-only\n", sb->s_id,
+	       err);
+}
+
+/*
+ * Blocks the running transaction may end up logging: those attached, the
+ * inode store blocks of its inodes, the superblock, the dirty bitmap blocks
+ * and the room reserved by the operations in flight. Called with j->lock.
+ */
+static uint32_t ouichefs_journal_used(struct ouichefs_journal *j)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(j->sb);
+
+	return j->nr + j->nr_inodes + 1 + j->reserved +
+	       bitmap_weight(sbi->bitmap_dirty,
+			     sbi->nr_ifree_blocks + sbi->nr_bfree_blocks);
+}
+
+/* Reserve room for an operation, return false if there is none left */
+static bool ouichefs_journal_reserve(struct ouichefs_journal *j)
+{
+	bool ok;
+
+	spin_lock(&j->lock);
+	ok = j->aborted ||
+	     ouichefs_journal_used(j) + OUICHEFS_JOURNAL_CREDITS <= j->max_bufs;
+	if (ok)
+		j->reserved += OUICHEFS_JOURNAL_CREDITS;
+	spin_unlock(&j->lock);
+	return ok;
+}
+
+static void ouichefs_journal_unreserve(struct ouichefs_journal *j)
+{
+	spin_lock(&j->lock);
+	j->reserved -= OUICHEFS_JOURNAL_CREDITS;
+	spin_unlock(&j->lock);
+	wake_up_all(&j->wait);
+}
+
+/*
+ * Start an operation: commits wait for it to end before logging the running
+ * transaction. Return false if the caller already runs one, in which case
+ * nothing is taken. Must be called outside of slice_lock.
+ */
+bool ouichefs_journal_start(struct super_block *sb)
+{
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+	uint32_t reserved;
+
+	if (!j || current->journal_info == j)
+		return false;
+
+	/*
+	 * Without room left, wait for the operations in flight to end, then
+	 * commit what they changed to start a new transaction.
+	 */
+	while (!ouichefs_journal_reserve(j)) {
+		reserved = READ_ONCE(j->reserved);
+		if (reserved)
+			wait_event(j->wait, READ_ONCE(j->reserved) < reserved ||
+					    READ_ONCE(j->aborted));
+		else
+			ouichefs_journal_force(sb);
+	}
+
+	down_read(&j->barrier);
+	current->journal_info = j;
+	return true;
+}
+
+/*
+ * Like ouichefs_journal_start(), but return false instead of waiting if a
+ * commit is running or waiting, or for room. Only for callers not running an
+ * operation.
+ */
+bool ouichefs_journal_trystart(struct super_block *sb)
+{
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+
+	if (!ouichefs_journal_reserve(j))
+		return false;
+	if (!down_read_trylock(&j->barrier)) {
+		ouichefs_journal_unreserve(j);
+		return false;
+	}
+	current->journal_info = j;
+	return true;
+}
+
+void ouichefs_journal_stop(struct super_block *sb, bool started)
+{
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+
+	if (!started)
+		return;
+	current->journal_info = NULL;
+	up_read(&j->barrier);
+	ouichefs_journal_unreserve(j);
+}
+
+/*
+ * Commit every few seconds, or right away once the transaction is full of
+ * changes made outside of any operation, which reserve no room. Unmount
+ * commits synchronously, once the workqueue is gone.
+ */
+static void ouichefs_journal_queue(struct super_block *sb, bool full)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	if (!(sb->s_flags & SB_ACTIVE))
+		return;
+	if (full)
+		mod_delayed_work(sbi->wq, &sbi->journal->commit_work, 0);
+	else
+		queue_delayed_work(sbi->wq, &sbi->journal->commit_work,
+				   OUICHEFS_JOURNAL_INTERVAL);
+}
+
+/*
+ * Attach bh, a modified metadata block, to the running transaction. Without
+ * a journal, bh is only marked dirty. Once the journal is aborted, it is left
+ * alone.
+ */
+void ouichefs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j = sbi->journal;
+	bool full;
+
+	if (!j) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+
+	spin_lock(&j->lock);
+	if (j->aborted ||
+	    test_and_set_bit(BH_OuichefsJournal, &bh->b_state)) {
+		spin_unlock(&j->lock);
+		return;
+	}
+	/* Operations reserve room, only a bug can get here */
+	if (WARN_ON_ONCE(j->nr == j->capacity)) {
+		clear_bit(BH_OuichefsJournal, &bh->b_state);
+		spin_unlock(&j->lock);
+		ouichefs_journal_abort(sb, -ENOSPC);
+		return;
+	}
+	get_bh(bh);
+	j->bhs[j->nr++] = bh;
+	full = ouichefs_journal_used(j) > j->max_bufs;
+	spin_unlock(&j->lock);
+
+	ouichefs_journal_queue(sb, full);
+}
+
+/* Inodes are logged at commit time, remember the ones changed */
+static void ouichefs_dirty_inode(struct inode *inode, int flags)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_journal *j = sbi->journal;
+	bool full;
+
+	if (!j || !(flags & I_DIRTY_INODE))
+		return;
+
+	spin_lock(&j->lock);
+	if (list_empty(&ci->i_jlist)) {
+		list_add_tail(&ci->i_jlist, &j->inodes);
+		j->nr_inodes++;
+	}
+	full = ouichefs_journal_used(j) > j->max_bufs;
+	spin_unlock(&j->lock);
+
+	ouichefs_journal_queue(inode->i_sb, full);
+}
+
+/* Copy the inodes of the running transaction to their inode store blocks */
+static void ouichefs_journal_log_inodes(struct ouichefs_journal *j)
+{
+	struct ouichefs_inode_info *ci;
+	struct buffer_head *bh;
+	struct inode *inode;
+
+	spin_lock(&j->lock);
+	while (!list_empty(&j->inodes)) {
+		ci = list_first_entry(&j->inodes, struct ouichefs_inode_info,
+				      i_jlist);
+		list_del_init(&ci->i_jlist);
+		j->nr_inodes--;
+		/* Inodes being evicted are not worth logging */
+		inode = igrab(&ci->vfs_inode);
+		spin_unlock(&j->lock);
+
+		if (inode) {
+			bh = ouichefs_copy_inode(inode);
+			if (!IS_ERR_OR_NULL(bh)) {
+				ouichefs_journal_dirty(j->sb, bh);
+				brelse(bh);
+			}
+			iput(inode);
+		}
+		spin_lock(&j->lock);
+	}
+	spin_unlock(&j->lock);
+}
+
+/*
+ * Keep freed block bno out of the bitmap until the running transaction is
+ * committed. Return false if there is no journal, or if bno could not be
+ * remembered, in which case the caller frees it right away.
+ */
+bool ouichefs_journal_pin(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_journal *j = sbi->journal;
+	bool in = current->journal_info == j;
+	int err;
+
+	if (!j)
+		return false;
+
+	/* fidx only changes under the barrier */
+	if (!in)
+		down_read(&j->barrier);
+	err = xa_err(xa_store(&j->freed[j->fidx], bno, xa_mk_value(0),
+			      GFP_NOFS));
+	if (!in)
+		up_read(&j->barrier);
+	if (err) {
+		pr_warn_ratelimited("Block %u freed unlogged (%d)\n", bno, err);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Keep the nr slices of mask in block_no out of the slice map until the
+ * running transaction is committed, like ouichefs_journal_pin() does for
+ * blocks. Return false if there is no journal, or if they could not be
+ * remembered, in which case the caller frees them right away.
+ */
+bool ouichefs_journal_pin_slices(struct super_block *sb, uint32_t block_no,
+				 uint64_t mask, uint32_t nr)
+{
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+	bool in = current->journal_info == j;
+	struct ouichefs_slice_run *run;
+
+	if (!j)
+		return false;
+
+	run = kmalloc(sizeof(*run), GFP_NOFS);
+	if (!run) {
+		pr_warn_ratelimited("Slices of %u freed unlogged\n", block_no);
+		return false;
+	}
+	run->block = block_no;
+	run->nr = nr;
+	run->mask = mask;
+
+	/* fidx only changes under the barrier */
+	if (!in)
+		down_read(&j->barrier);
+	spin_lock(&j->lock);
+	list_add_tail(&run->list, &j->freed_slices[j->fidx]);
+	spin_unlock(&j->lock);
+	if (!in)
+		up_read(&j->barrier);
+	return true;
+}
+
+/*
+ * Give the slice runs kept by a committed transaction back to the slice map,
+ * as long as the slice map blocks they change fit in the next commit. Those
+ * left wait for the one after, kept by the running transaction.
+ */
+static void ouichefs_journal_release_slices(struct super_block *sb,
+					    struct list_head *runs)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j = sbi->journal;
+	struct ouichefs_slice_run *run, *tmp;
+	bool room;
+
+	mutex_lock(&sbi->slice_lock);
+	list_for_each_entry_safe(run, tmp, runs, list) {
+		/* Its slice map entry and those of its partial list neighbours */
+		spin_lock(&j->lock);
+		room = ouichefs_journal_used(j) + 3 + OUICHEFS_JOURNAL_CREDITS <=
+		       j->max_bufs;
+		spin_unlock(&j->lock);
+		if (!room)
+			break;
+		list_del(&run->list);
+		__ouichefs_free_slices(sb, run->block, run->mask, run->nr);
+		kfree(run);
+	}
+	mutex_unlock(&sbi->slice_lock);
+
+	/* Called by the commit, fidx cannot change */
+	spin_lock(&j->lock);
+	list_splice_tail_init(runs, &j->freed_slices[j->fidx]);
+	spin_unlock(&j->lock);
+}
+
+/*
+ * Give the blocks kept by a committed transaction back to the bitmap, after
+ * discarding them with the discard mount option. The bitmap blocks changed go
+ * to disk with the next commit, those that would not fit in it wait for the
+ * one after, their blocks kept by the running transaction meanwhile.
+ */
+static void ouichefs_journal_release(struct super_block *sb,
+				     struct xarray *freed)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j = sbi->journal;
+	uint32_t bits = sbi->s_block_size * BITS_PER_BYTE;
+	unsigned long bno, start = 0, len = 0;
+	void *entry;
+	bool room;
+
+	if (xa_empty(freed))
+		return;
+
+	/* Called by the commit, fidx cannot change */
+	xa_for_each(freed, bno, entry) {
+		spin_lock(&j->lock);
+		room = test_bit(sbi->bfree.dirty + bno / bits,
+				sbi->bitmap_dirty) ||
+		       ouichefs_journal_used(j) + OUICHEFS_JOURNAL_CREDITS <
+			       j->max_bufs;
+		spin_unlock(&j->lock);
+		if (room || xa_err(xa_store(&j->freed[j->fidx], bno,
+					    xa_mk_value(0), GFP_NOFS)))
+			continue;
+		xa_erase(freed, bno);
+	}
+
+	/* Blocks come sorted, contiguous ones go as a single request */
+	if (sbi->s_mount_opt & OUICHEFS_MOUNT_DISCARD) {
+		xa_for_each(freed, bno, entry) {
+			if (len && bno == start + len) {
+				len++;
+				continue;
+			}
+			if (len)
+				sb_issue_discard(sb, start, len, GFP_NOFS, 0);
+			start = bno;
+			len = 1;
+		}
+		if (len)
+			sb_issue_discard(sb, start, len, GFP_NOFS, 0);
+	}
+	xa_for_each(freed, bno, entry)
+		ouichefs_bitmap_put(sbi, &sbi->bfree, &sbi->nr_free_blocks,
+				    bno);
+	xa_destroy(freed);
+
+	if (sb->s_flags & SB_ACTIVE)
+		queue_delayed_work(sbi->wq, &sbi->journal->commit_work,
+				   OUICHEFS_JOURNAL_INTERVAL);
+}
+
+/* Wait for the nr buffers of bhs, return -EIO if any write failed */
+static int ouichefs_journal_wait(struct buffer_head **bhs, uint32_t nr)
+{
+	int ret = 0;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			ret = -EIO;
+	}
+	return ret;
+}
+
+/*
+ * Write the committed copies of the nr blocks of bhs, held in the journal
+ * area buffers of jbhs, to their home location. The live buffers are not
+ * touched, they may already belong to the next transaction. Consumes bhs.
+ */
+static int ouichefs_journal_checkpoint(struct super_block *sb,
+				       struct buffer_head **bhs,
+				       struct buffer_head **jbhs, uint32_t nr)
+{
+	struct buffer_head *tmp;
+	struct blk_plug plug;
+	int ret = 0;
+	uint32_t i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		tmp = alloc_buffer_head(GFP_NOFS | __GFP_NOFAIL);
+		folio_set_bh(tmp, jbhs[i]->b_folio, bh_offset(jbhs[i]));
+		tmp->b_bdev = sb->s_bdev;
+		tmp->b_blocknr = bhs[i]->b_blocknr;
+		tmp->b_size = sb->s_blocksize;
+		set_buffer_mapped(tmp);
+		set_buffer_uptodate(tmp);
+		brelse(bhs[i]);
+		bhs[i] = tmp;
+
+		lock_buffer(tmp);
+		get_bh(tmp);
+		tmp->b_end_io = end_buffer_write_sync;
+		submit_bh(REQ_OP_WRITE | REQ_SYNC, tmp);
+	}
+	blk_finish_plug(&plug);
+
+	ret = ouichefs_journal_wait(bhs, nr);
+	for (i = 0; i < nr; i++)
+		free_buffer_head(bhs[i]);
+	return ret;
+}
+
+/*
+ * Commit the running transaction, unless transaction tid was committed by
+ * somebody else meanwhile. Any failure aborts the journal.
+ */
+static int ouichefs_journal_commit(struct super_block *sb, uint64_t tid)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j = sbi->journal;
+	struct ouichefs_sync s = { .nr = 0, .ret = 0, .j = j };
+	struct ouichefs_journal_desc *desc;
+	struct buffer_head *dbh;
+	struct list_head *runs;
+	struct blk_plug plug;
+	struct xarray *freed;
+	uint32_t base, i, n;
+	uint64_t done;
+	u32 csum = ~0U;
+	int ret = 0;
+
+	mutex_lock(&j->commit_mutex);
+	if (j->committed >= tid || j->aborted)
+		goto unlock;
+
+	/* No operation in flight from here, log a consistent state */
+	down_write(&j->barrier);
+	current->journal_info = j;
+	ouichefs_journal_log_inodes(j);
+	/* Unlinks of this transaction free their blocks in it */
+	ouichefs_reclaim_pending(sbi);
+
+	spin_lock(&j->lock);
+	swap(j->bhs, j->cbhs);
+	j->cnr = j->nr;
+	j->nr = 0;
+	for (i = 0; i < j->cnr; i++)
+		clear_bit(BH_OuichefsJournal, &j->cbhs[i]->b_state);
+	done = j->tid++;
+	spin_unlock(&j->lock);
+	freed = &j->freed[j->fidx];
+	runs = &j->freed_slices[j->fidx];
+	j->fidx ^= 1;
+
+	/* Freed blocks need a descriptor superseding those that logged them */
+	if (!j->cnr && xa_empty(freed) && list_empty(runs) &&
+	    bitmap_empty(sbi->bitmap_dirty, sbi->nr_ifree_blocks +
+			 sbi->nr_bfree_blocks)) {
+		current->journal_info = NULL;
+		up_write(&j->barrier);
+		j->committed = done;
+		goto unlock;
+	}
+	/* Operations reserved room for these in the half */
+	ret = sync_sb_info(sb, &s);
+	if (!ret)
+		ret = sync_ifree(sb, &s);
+	if (!ret)
+		ret = sync_bfree(sb, &s);
+	if (!ret)
+		ret = s.ret;
+
+	base = j->start + j->next * j->half;
+	for (i = 0, n = 0; i < j->cnr; i++) {
+		struct buffer_head *bh = j->cbhs[i], *jbh = NULL;
+
+		/* Freed by this transaction, the block has no content to keep */
+		if (!ret && !xa_load(freed, bh->b_blocknr)) {
+			jbh = sb_getblk(sb, base + 1 + n);
+			if (!jbh)
+				ret = -ENOMEM;
+		}
+		if (!jbh) {
+			brelse(bh);
+			continue;
+		}
+		lock_buffer(jbh);
+		memcpy(jbh->b_data, bh->b_data, sb->s_blocksize);
+		set_buffer_uptodate(jbh);
+		unlock_buffer(jbh);
+		csum = crc32c(csum, jbh->b_data, sb->s_blocksize);
+		j->cbhs[n] = bh;
+		j->jbhs[n++] = jbh;
+	}
+	j->cnr = n;
+	current->journal_info = NULL;
+	up_write(&j->barrier);
+	if (ret)
+		goto abort;
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	/* Logged blocks first, then the descriptor that validates them */
+	blk_start_plug(&plug);
+	for (i = 0; i < j->cnr; i++) {
+		mark_buffer_dirty(j->jbhs[i]);
+		write_dirty_buffer(j->jbhs[i], REQ_SYNC);
+	}
+	blk_finish_plug(&plug);
+	ret = ouichefs_journal_wait(j->jbhs, j->cnr);
 
-	return 0;
+	/* The flush also covers the data written by fsync callers */
+	if (!ret)
+		ret = ouichefs_flush_device(sb, ouichefs_flush_ticket(sb));
+	if (ret)
+		goto abort;
+
+	dbh = sb_getblk(sb, base);
+	if (!dbh) {
+		ret = -ENOMEM;
+		goto abort;
+	}
+	lock_buffer(dbh);
+	memset(dbh->b_data, 0, sb->s_blocksize);
+	desc = (struct ouichefs_journal_desc *)dbh->b_data;
+	desc->magic = cpu_to_le32(OUICHEFS_JOURNAL_MAGIC);
+	desc->nr = cpu_to_le32(j->cnr);
+	desc->seq = cpu_to_le64(j->seq);
+	for (i = 0; i < j->cnr; i++)
+		desc->blocks[i] = cpu_to_le32(j->cbhs[i]->b_blocknr);
+	desc->csum = cpu_to_le32(ouichefs_journal_csum(csum, desc,
+						      sb->s_blocksize));
+	set_buffer_uptodate(dbh);
+	unlock_buffer(dbh);
+	mark_buffer_dirty(dbh);
+	ret = __sync_dirty_buffer(dbh, REQ_SYNC | REQ_FUA);
+	brelse(dbh);
+	if (ret)
+		goto abort;
+	j->next ^= 1;
+	j->seq++;
+
+	/*
+	 * Checkpoint: the half is reused two commits from now. Should it fail,
+	 * the journal stops there, the next mount replays this commit.
+	 */
+	ret = ouichefs_journal_checkpoint(sb, j->cbhs, j->jbhs, j->cnr);
+	for (i = 0; i < j->cnr; i++)
+		brelse(j->jbhs[i]);
+	j->cnr = 0;
+	if (ret) {
+		ouichefs_journal_abort(sb, ret);
+		goto unlock;
+	}
+
+	ouichefs_journal_release_slices(sb, runs);
+	ouichefs_journal_release(sb, freed);
+	j->committed = done;
+	j->err = 0;
+	goto unlock;
+
+abort:
+	/* Nothing went home, the partition is as of the previous commit */
+	for (i = 0; i < j->cnr; i++) {
+		brelse(j->cbhs[i]);
+		brelse(j->jbhs[i]);
+	}
+	j->cnr = 0;
+	ouichefs_journal_abort(sb, ret);
+unlock:
+	ret = j->err;
+	mutex_unlock(&j->commit_mutex);
+	return ret;
 }
 
-static int sync_sb_info(struct super_block *sb, int wait)
+/*
+ * Commit everything changed so far and wait for it to be on disk. Inside an
+ * operation or a commit, which would wait for themselves, the changes are left
+ * to the commit that follows.
+ */
+int ouichefs_journal_force(struct super_block *sb)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
-	struct buffer_head *bh;
+	struct ouichefs_journal *j = ouichefs_journal(sb);
 
-	/* Flush superblock */
-	bh = sb_bread(sb, 0);
-	if (!bh)
-		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+	if (current->journal_info == j)
+		return 0;
+	return ouichefs_journal_commit(sb, READ_ONCE(j->tid));
+}
 
-	disk_sb->nr_blocks = cpu_to_le32(sbi->nr_blocks);
-	disk_sb->nr_inodes = cpu_to_le32(sbi->nr_inodes);
-	disk_sb->nr_istore_blocks = cpu_to_le32(sbi->nr_istore_blocks);
-	disk_sb->nr_ifree_blocks = cpu_to_le32(sbi->nr_ifree_blocks);
-	disk_sb->nr_bfree_blocks = cpu_to_le32(sbi->nr_bfree_blocks);
-	disk_sb->nr_free_inodes = cpu_to_le32(sbi->nr_free_inodes);
-	disk_sb->nr_free_blocks = cpu_to_le32(sbi->nr_free_blocks);
+/*
+ * An allocation failed in an operation that has ended since: return true if
+ * the operation is worth retrying, once the blocks freed by the running
+ * transaction are committed and back in the bitmap. retries counts attempts.
+ */
+bool ouichefs_journal_retry_alloc(struct super_block *sb, int *retries)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j = sbi->journal;
 
-	mark_buffer_dirty(bh);
-	if (wait)
-		sync_dirty_buffer(bh);
-	brelse(bh);
+	if (!j || current->journal_info == j || (*retries)++ >= 3)
+		return false;
 
-	return 0;
+	/* Blocks of unlinked files are pinned once reclaimed */
+	flush_work(&sbi->reclaim_work);
+	if (xa_empty(&j->freed[READ_ONCE(j->fidx)]) &&
+	    list_empty(&j->freed_slices[READ_ONCE(j->fidx)]))
+		return false;
+	return !ouichefs_journal_force(sb);
 }
 
-static int sync_ifree(struct super_block *sb, int wait)
+/*
+ * Commit until nothing is left to commit, for unmount: each commit gives back
+ * what the previous one freed, which changes the bitmaps and the slice map.
+ */
+static void ouichefs_journal_drain(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
+	struct ouichefs_journal *j = sbi->journal;
+
+	while (!ouichefs_journal_force(sb)) {
+		if (!j->nr && list_empty(&j->inodes) &&
+		    xa_empty(&j->freed[j->fidx]) &&
+		    list_empty(&j->freed_slices[j->fidx]) &&
+		    bitmap_empty(sbi->bitmap_dirty, sbi->nr_ifree_blocks +
+				 sbi->nr_bfree_blocks))
+			break;
+	}
+}
 
-	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
+static void ouichefs_journal_work(struct work_struct *work)
+{
+	struct ouichefs_journal *j = container_of(to_delayed_work(work),
+						  struct ouichefs_journal,
+						  commit_work);
 
-		bh = sb_bread(sb, idx);
+	ouichefs_journal_commit(j->sb, READ_ONCE(j->tid));
+}
+
+/*
+ * Replay the last transaction of the journal area of nr blocks at start, if
+ * any. Set seq and next to the sequence number and half of the next commit.
+ */
+static int ouichefs_journal_replay(struct super_block *sb, uint32_t start,
+				   uint32_t nr, uint64_t *seq,
+				   unsigned int *next)
+{
+	struct ouichefs_sync s = { .nr = 0, .ret = 0 };
+	uint32_t half = nr / 2, cap = ouichefs_journal_capacity(sb, half);
+	struct ouichefs_journal_desc *d;
+	struct buffer_head *dbh = NULL, *bh, *jbh;
+	uint32_t i, n, base = 0;
+	unsigned int h;
+	struct blk_plug plug;
+	u32 csum;
+
+	*seq = 0;
+	*next = 0;
+	for (h = 0; h < 2; h++) {
+		bh = sb_bread(sb, start + h * half);
 		if (!bh)
 			return -EIO;
+		d = (struct ouichefs_journal_desc *)bh->b_data;
+		n = le32_to_cpu(d->nr);
+		if (le32_to_cpu(d->magic) != OUICHEFS_JOURNAL_MAGIC || n > cap ||
+		    le64_to_cpu(d->seq) <= *seq) {
+			brelse(bh);
+			continue;
+		}
+		csum = ~0U;
+		for (i = 0; i < n; i++) {
+			jbh = sb_bread(sb, start + h * half + 1 + i);
+			if (!jbh)
+				break;
+			csum = crc32c(csum, jbh->b_data, sb->s_blocksize);
+			brelse(jbh);
+		}
+		if (i < n || ouichefs_journal_csum(csum, d, sb->s_blocksize) !=
+			     le32_to_cpu(d->csum)) {
+			brelse(bh);
+			continue;
+		}
+		brelse(dbh);
+		dbh = bh;
+		base = start + h * half;
+		*seq = le64_to_cpu(d->seq);
+		*next = !h;
+	}
+	if (!dbh)
+		return 0;
 
-		copy_bitmap_to_le64((__le64 *)bh->b_data,
-			(void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE);
+	/* Logged blocks may be newer than their home copy, write them back */
+	d = (struct ouichefs_journal_desc *)dbh->b_data;
+	n = le32_to_cpu(d->nr);
+	blk_start_plug(&plug);
+	for (i = 0; i < n; i++) {
+		jbh = sb_bread(sb, base + 1 + i);
+		bh = jbh ? sb_getblk(sb, le32_to_cpu(d->blocks[i])) : NULL;
+		if (!bh) {
+			brelse(jbh);
+			s.ret = -EIO;
+			break;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, jbh->b_data, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		brelse(jbh);
+		sync_buffer(&s, bh);
+	}
+	sync_wait(&s);
+	blk_finish_plug(&plug);
+	brelse(dbh);
+	if (!s.ret)
+		s.ret = blkdev_issue_flush(sb->s_bdev);
+	if (s.ret)
+		return s.ret;
+
+	pr_info("%s: replayed %u blocks of commit %llu\n", sb->s_id, n, *seq);
+	return 0;
+}
 
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
-		brelse(bh);
+static int ouichefs_journal_init(struct super_block *sb, uint64_t seq,
+				 unsigned int next)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_journal *j;
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+	j->sb = sb;
+	j->start = sbi->s_journal_start;
+	j->half = sbi->s_journal_blocks / 2;
+	j->capacity = ouichefs_journal_capacity(sb, j->half);
+	/* Inodes freed by the commit itself are logged in the room left */
+	j->max_bufs = j->capacity - OUICHEFS_JOURNAL_CREDITS;
+	if (j->max_bufs < 2 * OUICHEFS_JOURNAL_CREDITS) {
+		pr_err("Journal area too small, commits log %u blocks at most\n",
+		       j->capacity);
+		kfree(j);
+		return -EINVAL;
+	}
+	j->next = next;
+	j->seq = seq + 1;
+	j->tid = 1;
+	init_rwsem(&j->barrier);
+	mutex_init(&j->commit_mutex);
+	spin_lock_init(&j->lock);
+	INIT_LIST_HEAD(&j->inodes);
+	init_waitqueue_head(&j->wait);
+	xa_init(&j->freed[0]);
+	xa_init(&j->freed[1]);
+	INIT_LIST_HEAD(&j->freed_slices[0]);
+	INIT_LIST_HEAD(&j->freed_slices[1]);
+	INIT_DELAYED_WORK(&j->commit_work, ouichefs_journal_work);
+
+	j->bhs = kcalloc(j->capacity, sizeof(*j->bhs), GFP_KERNEL);
+	j->cbhs = kcalloc(j->capacity, sizeof(*j->cbhs), GFP_KERNEL);
+	j->jbhs = kcalloc(j->capacity, sizeof(*j->jbhs), GFP_KERNEL);
+	if (!j->bhs || !j->cbhs || !j->jbhs) {
+		kfree(j->bhs);
+		kfree(j->cbhs);
+		kfree(j->jbhs);
+		kfree(j);
+		return -ENOMEM;
 	}
+	sbi->journal = j;
 
 	return 0;
 }
 
-static int sync_bfree(struct super_block *sb, int wait)
+static void ouichefs_journal_destroy(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct buffer_head *bh;
-	int i, idx;
+	struct ouichefs_journal *j = sbi->journal;
+	struct ouichefs_slice_run *run, *tmp;
+	int i;
+
+	if (!j)
+		return;
+	sbi->journal = NULL;
+	/* Left by an aborted journal */
+	while (j->nr) {
+		clear_bit(BH_OuichefsJournal, &j->bhs[--j->nr]->b_state);
+		brelse(j->bhs[j->nr]);
+	}
+	xa_destroy(&j->freed[0]);
+	xa_destroy(&j->freed[1]);
+	for (i = 0; i < 2; i++) {
+		list_for_each_entry_safe(run, tmp, &j->freed_slices[i], list)
+			kfree(run);
+	}
+	kfree(j->bhs);
+	kfree(j->cbhs);
+	kfree(j->jbhs);
+	kfree(j);
+}
 
-	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+/*
+ * Invalidate both descriptors once everything is home, so that the next mount
+ * of a cleanly unmounted partition replays nothing.
+ */
+static void ouichefs_journal_clear(struct super_block *sb)
+{
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+	struct buffer_head *bh;
+	unsigned int h;
 
-		bh = sb_bread(sb, idx);
+	for (h = 0; h < 2; h++) {
+		bh = sb_getblk(sb, j->start + h * j->half);
 		if (!bh)
-			return -EIO;
-
-		copy_bitmap_to_le64((__le64 *)bh->b_data,
-			(void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE);
-
+			continue;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
 		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
+		sync_dirty_buffer(bh);
 		brelse(bh);
 	}
-
-	return 0;
+	blkdev_issue_flush(sb->s_bdev);
 }
 
+
+static int ouichefs_sync_fs(struct super_block *sb, int wait);
+
 static void ouichefs_put_super(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
 		ouichefs_sysfs_cleanup(sb);
-		kfree(sbi->ifree_bitmap);
-		kfree(sbi->bfree_bitmap);
+		/*
+		 * Pending reclaim and evicted orphans changed the bitmaps after
+		 * the last sync_fs, write them again.
+		 */
+		if (sbi->journal)
+			cancel_delayed_work_sync(&sbi->journal->commit_work);
+		destroy_workqueue(sbi->wq);
+		ouichefs_bitmap_drain(sbi, &sbi->ifree, &sbi->nr_free_inodes);
+		ouichefs_bitmap_drain(sbi, &sbi->bfree, &sbi->nr_free_blocks);
+		ouichefs_sync_fs(sb, 1);
+		if (sbi->journal) {
+			/* What the last commits freed went back after them */
+			ouichefs_journal_drain(sb);
+			/* After an abort, the next mount replays the last commit */
+			if (!sbi->journal->aborted)
+				ouichefs_journal_clear(sb);
+			ouichefs_journal_destroy(sb);
+		}
+		bitmap_free(sbi->bitmap_dirty);
+		ouichefs_bitmap_destroy(&sbi->ifree);
+		ouichefs_bitmap_destroy(&sbi->bfree);
 		kfree(sbi);
 	}
 }
 
+/*
+ * Inodes are freed on unlink, except O_TMPFILE ones never linked, which go
+ * away with their last reference.
+ */
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_journal *j = ouichefs_journal(sb);
+	struct buffer_head *bh;
+	bool h;
+
+	truncate_inode_pages_final(&inode->i_data);
+	if (!inode->i_nlink &&
+	    (OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_ORPHAN)) {
+		h = ouichefs_journal_start(sb);
+		ouichefs_free_inode(inode);
+		ouichefs_orphan_del(sb);
+		/* Commits skip inodes being evicted, log this one now */
+		bh = ouichefs_copy_inode(inode);
+		if (!IS_ERR_OR_NULL(bh)) {
+			ouichefs_journal_dirty(sb, bh);
+			brelse(bh);
+		}
+		ouichefs_journal_stop(sb, h);
+	}
+	/* Only now, freeing the inode dirtied it again */
+	if (j) {
+		spin_lock(&j->lock);
+		if (!list_empty(&OUICHEFS_INODE(inode)->i_jlist)) {
+			list_del_init(&OUICHEFS_INODE(inode)->i_jlist);
+			j->nr_inodes--;
+		}
+		spin_unlock(&j->lock);
+	}
+	clear_inode(inode);
+}
+
 static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sync s = { .nr = 0, .ret = 0 };
+	struct blk_plug plug;
 	int ret = 0;
 
-	ret = sync_sb_info(sb, wait);
-	if (ret)
-		return ret;
-	ret = sync_ifree(sb, wait);
-	if (ret)
-		return ret;
-	ret = sync_bfree(sb, wait);
-	if (ret)
-		return ret;
+	/* Blocks of unlinked files must be free in the bitmap we write */
+	if (wait)
+		flush_work(&sbi->reclaim_work);
 
-	return 0;
+	/* Bitmaps and superblock go through the journal with the rest */
+	if (sbi->journal) {
+		if (wait)
+			return ouichefs_journal_force(sb);
+		mod_delayed_work(sbi->wq, &sbi->journal->commit_work, 0);
+		return 0;
+	}
+
+	blk_start_plug(&plug);
+	ret = sync_sb_info(sb, wait ? &s : NULL);
+	if (!ret)
+		ret = sync_ifree(sb, wait ? &s : NULL);
+	if (!ret)
+		ret = sync_bfree(sb, wait ? &s : NULL);
+	sync_wait(&s);
+	blk_finish_plug(&plug);
+
+	return ret ? ret : s.ret;
 }
 
 static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -214,39 +1840,300 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	stat->f_type = OUICHEFS_MAGIC;
-	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
+	stat->f_bsize = sb->s_blocksize;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	stat->f_bfree = count_free_blocks(sbi);
+	stat->f_bavail = stat->f_bfree;
 	stat->f_files = sbi->nr_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
+	stat->f_ffree = count_free_inodes(sbi);
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
 
 	return 0;
 }
 
+static int ouichefs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(root->d_sb);
+
+	if (sbi->s_mount_opt & OUICHEFS_MOUNT_DISCARD)
+		seq_puts(m, ",discard");
+	return 0;
+}
+
+/*
+ * Discard the nr blocks and mark them free. Blocks are sorted so that
+ * contiguous ones go to the device as a single request, and only put back
+ * once discarded, so that nobody writes to them in between.
+ */
+void ouichefs_discard_blocks(struct super_block *sb, uint32_t *blocks, int nr)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	int i, start;
+
+	/* The commit freeing them discards them, once they can be reused */
+	if (sbi->journal) {
+		for (i = 0; i < nr; i++)
+			put_block(sbi, blocks[i]);
+		return;
+	}
+
+	sort(blocks, nr, sizeof(uint32_t), ouichefs_cmp_u32, NULL);
+	for (start = 0, i = 1; i <= nr; i++) {
+		if (i < nr && blocks[i] == blocks[i - 1] + 1)
+			continue;
+		sb_issue_discard(sb, blocks[start], i - start, GFP_NOFS, 0);
+		start = i;
+	}
+	for (i = 0; i < nr; i++)
+		put_block(sbi, blocks[i]);
+}
+
+/*
+ * FITRIM: discard the runs of free blocks of the range that are at least
+ * minlen long. Each run is taken out of the bitmap while its discard is in
+ * flight, and range.len is set to the number of bytes discarded.
+ */
+int ouichefs_trim_fs(struct super_block *sb, struct fstrim_range __user *arg)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct fstrim_range range;
+	unsigned long start, end, minblks, first, last, base, size;
+	unsigned long bits = sb->s_blocksize * BITS_PER_BYTE;
+	unsigned long *map;
+	uint64_t trimmed = 0;
+	int ret = 0;
+	bool h;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!bdev_max_discard_sectors(sb->s_bdev))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	start = range.start >> sb->s_blocksize_bits;
+	if (start >= sbi->nr_blocks)
+		return -EINVAL;
+	end = sbi->nr_blocks;
+	if (range.len >> sb->s_blocksize_bits < end - start)
+		end = start + (range.len >> sb->s_blocksize_bits);
+	minblks = max_t(u64, 1, range.minlen >> sb->s_blocksize_bits);
+	minblks = max_t(unsigned long, minblks,
+			bdev_discard_granularity(sb->s_bdev) >>
+			sb->s_blocksize_bits);
+
+	/* Blocks of unlinked files are worth trimming too */
+	flush_work(&sbi->reclaim_work);
+
+	/* Runs are searched one bitmap block at a time and never span two */
+	while (start < end) {
+		base = start - start % bits;
+		size = min(end - base, bits);
+		map = ouichefs_bitmap_load(&sbi->bfree, start / bits);
+		if (!map) {
+			start = base + size;
+			continue;
+		}
+
+		spin_lock(&sbi->bitmap_lock);
+		first = find_next_bit(map, size, start - base);
+		last = find_next_zero_bit(map, size, first);
+		if (first < size && last - first >= minblks) {
+			bitmap_clear(map, first, last - first);
+			sbi->nr_free_blocks -= last - first;
+			sbi->bfree.nr_free[start / bits] -= last - first;
+			if (!sbi->bfree.nr_free[start / bits])
+				ouichefs_bitmap_clear_avail(&sbi->bfree,
+							    start / bits);
+		} else {
+			first = last;
+		}
+		spin_unlock(&sbi->bitmap_lock);
+
+		if (first < last) {
+			ret = sb_issue_discard(sb, base + first, last - first,
+					       GFP_NOFS, 0);
+			/* The bitmap block may go to the journal again */
+			h = ouichefs_journal_start(sb);
+			spin_lock(&sbi->bitmap_lock);
+			bitmap_set(map, first, last - first);
+			sbi->nr_free_blocks += last - first;
+			if (!sbi->bfree.nr_free[start / bits])
+				ouichefs_bitmap_set_avail(&sbi->bfree,
+							  start / bits);
+			sbi->bfree.nr_free[start / bits] += last - first;
+			/* A sync_fs may have seen the run in use meanwhile */
+			mark_bitmap_dirty(sbi, &sbi->bfree, base + first);
+			spin_unlock(&sbi->bitmap_lock);
+			ouichefs_journal_stop(sb, h);
+			if (ret)
+				break;
+			trimmed += last - first;
+		}
+		start = base + last;
+
+		if (fatal_signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+
+	range.len = trimmed << sb->s_blocksize_bits;
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return ret;
+}
+
 static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
+	.dirty_inode = ouichefs_dirty_inode,
 	.write_inode = ouichefs_write_inode,
+	.evict_inode = ouichefs_evict_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
+	.show_options = ouichefs_show_options,
 };
 
+/* Parse the comma-separated mount options in data */
+static int ouichefs_parse_options(struct super_block *sb, char *data)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	char *p;
+
+	while ((p = strsep(&data, ",")) != NULL) {
+		if (!*p)
+			continue;
+		if (!strcmp(p, "discard")) {
+			sbi->s_mount_opt |= OUICHEFS_MOUNT_DISCARD;
+		} else if (!strcmp(p, "nodiscard")) {
+			sbi->s_mount_opt &= ~OUICHEFS_MOUNT_DISCARD;
+		} else if (!strcmp(p, "lazytime")) {
+			/* Usually turned into SB_LAZYTIME by mount(8) already */
+			sb->s_flags |= SB_LAZYTIME;
+		} else if (!strcmp(p, "nolazytime")) {
+			sb->s_flags &= ~SB_LAZYTIME;
+		} else {
+			pr_err("Unknown mount option %s\n", p);
+			return -EINVAL;
+		}
+	}
+
+	if ((sbi->s_mount_opt & OUICHEFS_MOUNT_DISCARD) &&
+	    !bdev_max_discard_sectors(sb->s_bdev)) {
+		pr_warn("Device does not support discard, ignoring it\n");
+		sbi->s_mount_opt &= ~OUICHEFS_MOUNT_DISCARD;
+	}
+
+	return 0;
+}
+
+/*
+ * Count a new O_TMPFILE inode in the superblock, so that the next mount looks
+ * for it if it is still there. With a journal, the count is logged with the
+ * inode. Without one, it must be on disk before the inode can be: the first
+ * orphan writes the superblock right away.
+ */
+void ouichefs_orphan_add(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_sync s = { .nr = 0, .ret = 0 };
+	bool first;
+
+	spin_lock(&sbi->bitmap_lock);
+	first = !sbi->s_nr_orphans++;
+	spin_unlock(&sbi->bitmap_lock);
+
+	if (first && !sbi->journal && !sync_sb_info(sb, &s))
+		sync_wait(&s);
+}
+
+/* An O_TMPFILE inode got a name or was freed */
+void ouichefs_orphan_del(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	spin_lock(&sbi->bitmap_lock);
+	if (sbi->s_nr_orphans)
+		sbi->s_nr_orphans--;
+	spin_unlock(&sbi->bitmap_lock);
+}
+
+/*
+ * O_TMPFILE inodes still open when the partition went down were neither linked
+ * nor freed. Look for them among the used inodes and free them, evicting an
+ * orphan frees it. Only called when the superblock counts some.
+ */
+static void ouichefs_free_orphans(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_bitmap *bm = &sbi->ifree;
+	uint32_t per_block = sb->s_blocksize * BITS_PER_BYTE;
+	uint32_t idx, bit, size, ino, blk, nr = 0;
+	struct ouichefs_inode *cinode;
+	struct buffer_head *bh = NULL;
+	struct inode *inode;
+	unsigned long *map;
+
+	for (idx = 0; idx < bm->nr_blocks; idx++) {
+		map = ouichefs_bitmap_load(bm, idx);
+		if (!map)
+			continue;
+		size = min(per_block, bm->nr_bits - idx * per_block);
+		/* Free inodes have their bit set */
+		for_each_clear_bit(bit, map, size) {
+			ino = idx * per_block + bit;
+			if (ino <= 1)
+				continue;
+			blk = ino / OUICHEFS_INODES_PER_BLOCK(sb) + 1;
+			if (!bh || bh->b_blocknr != blk) {
+				brelse(bh);
+				bh = sb_bread(sb, blk);
+				if (!bh)
+					continue;
+			}
+			cinode = ouichefs_disk_inode(sb, bh, ino);
+			if (!(le32_to_cpu(cinode->i_flags) & OUICHEFS_INODE_ORPHAN))
+				continue;
+
+			inode = ouichefs_iget(sb, ino);
+			if (IS_ERR(inode))
+				continue;
+			clear_nlink(inode);
+			iput(inode);
+			nr++;
+		}
+	}
+	brelse(bh);
+
+	/* Whatever was counted and not found is gone */
+	spin_lock(&sbi->bitmap_lock);
+	sbi->s_nr_orphans = 0;
+	spin_unlock(&sbi->bitmap_lock);
+
+	if (nr)
+		pr_info("%s: freed %u orphan inodes\n", sb->s_id, nr);
+}
+
 /* Fill the struct superblock from partition superblock */
+
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh = NULL;
 	struct ouichefs_sb_info *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	uint32_t block_size, slice_size, jstart = 0, jblocks = 0;
+	unsigned int jnext = 0;
+	uint64_t jseq = 0;
+	int ret = 0;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
-	sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE);
-	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE;
+	if (!sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE))
+		return -EINVAL;
 	sb->s_op = &ouichefs_super_ops;
 	sb->s_time_gran = 1;
 
@@ -263,6 +2150,57 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		return -EPERM;
 	}
 
+	/* Check the geometry chosen at mkfs time */
+	block_size = le32_to_cpu(csb->s_block_size);
+	slice_size = le32_to_cpu(csb->s_slice_size);
+	if (block_size < OUICHEFS_BLOCK_SIZE ||
+	    block_size > OUICHEFS_MAX_BLOCK_SIZE || !is_power_of_2(block_size)) {
+		pr_err("Unsupported block size %u, reformat it\n", block_size);
+		brelse(bh);
+		return -EINVAL;
+	}
+	if (!is_power_of_2(slice_size) || slice_size > block_size ||
+	    block_size / slice_size > OUICHEFS_MAX_SLICES_PER_BLOCK) {
+		pr_err("Unsupported slice size %u\n", slice_size);
+		brelse(bh);
+		return -EINVAL;
+	}
+
+	/* The superblock sits at offset 0 whatever the block size */
+	if (block_size != sb->s_blocksize) {
+		brelse(bh);
+		if (!sb_set_blocksize(sb, block_size)) {
+			pr_err("Block size %u not supported by this kernel\n",
+			       block_size);
+			return -EINVAL;
+		}
+		bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
+		if (!bh)
+			return -EIO;
+		csb = (struct ouichefs_sb_info *)bh->b_data;
+	}
+	/* Bring metadata back to the last commit before looking at it */
+	if (le32_to_cpu(csb->s_features) & OUICHEFS_FEATURE_JOURNAL) {
+		jstart = le32_to_cpu(csb->s_journal_start);
+		jblocks = le32_to_cpu(csb->s_journal_blocks);
+		if (jblocks < 4 || jblocks % 2 ||
+		    jstart + jblocks > le32_to_cpu(csb->nr_blocks)) {
+			pr_err("Bad journal area %u+%u\n", jstart, jblocks);
+			brelse(bh);
+			return -EINVAL;
+		}
+		ret = ouichefs_journal_replay(sb, jstart, jblocks, &jseq,
+					      &jnext);
+		if (ret) {
+			pr_err("Journal replay failed (%d)\n", ret);
+			brelse(bh);
+			return ret;
+		}
+	}
+	/* A file is an index block worth of data blocks */
+	sb->s_maxbytes = min_t(loff_t, (loff_t)OUICHEFS_INDEX_ENTRIES(sb) *
+				       block_size, U32_MAX);
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -276,61 +2214,128 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_bfree_blocks = le32_to_cpu(csb->nr_bfree_blocks);
 	sbi->nr_free_inodes = le32_to_cpu(csb->nr_free_inodes);
 	sbi->nr_free_blocks = le32_to_cpu(csb->nr_free_blocks);
+	sbi->nr_smap_blocks = le32_to_cpu(csb->nr_smap_blocks);
+	sbi->s_free_sliced_blocks = le32_to_cpu(csb->s_free_sliced_blocks);
+	sbi->s_features = le32_to_cpu(csb->s_features);
+	sbi->s_block_size = block_size;
+	sbi->s_slice_size = slice_size;
+	sbi->s_inode_size = le32_to_cpu(csb->s_inode_size);
+	sbi->s_journal_start = jstart;
+	sbi->s_journal_blocks = jblocks;
+	sbi->s_nr_orphans = le32_to_cpu(csb->s_nr_orphans);
+	sbi->slices_per_block = block_size / slice_size;
+	sbi->slice_bitmap_full = GENMASK_ULL(sbi->slices_per_block - 1, 0);
+	mutex_init(&sbi->slice_lock);
+	spin_lock_init(&sbi->usage_lock);
+	spin_lock_init(&sbi->bitmap_lock);
+	spin_lock_init(&sbi->reclaim_lock);
+	mutex_init(&sbi->flush_mutex);
+	INIT_LIST_HEAD(&sbi->reclaim_list);
+	INIT_WORK(&sbi->reclaim_work, ouichefs_reclaim_work);
 	sb->s_fs_info = sbi;
 
+	if (sbi->s_features & ~OUICHEFS_FEATURE_ALL) {
+		pr_err("Unknown features 0x%x\n",
+		       sbi->s_features & ~OUICHEFS_FEATURE_ALL);
+		brelse(bh);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+
+	/*
+	 * Older mkfs versions did not record the inode size, and it changed
+	 * between them, so there is no telling the layout of the inode store.
+	 */
+	if (!sbi->s_inode_size) {
+		pr_err("No inode size on this partition, reformat it\n");
+		brelse(bh);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+	if (sbi->s_inode_size < sizeof(struct ouichefs_inode) ||
+	    sbi->s_inode_size > OUICHEFS_INODE_SIZE) {
+		pr_err("Unsupported inode size %u\n", sbi->s_inode_size);
+		brelse(bh);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+	sbi->inodes_per_block = block_size / sbi->s_inode_size;
+	sbi->inline_size = sbi->s_inode_size - sizeof(struct ouichefs_inode);
+
+	/* Directory usage lives in the inline data area */
+	if ((sbi->s_features & OUICHEFS_FEATURE_DIR_USAGE) &&
+	    sbi->inline_size < sizeof(struct ouichefs_disk_usage)) {
+		pr_err("No room for directory usage in %u-byte inodes\n",
+		       sbi->s_inode_size);
+		brelse(bh);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+
+	/* Legacy slice pointers only have room for 32 slice numbers */
+	if (sbi->slices_per_block > SLICE32_MAX_SLICES &&
+	    !(sbi->s_features & OUICHEFS_FEATURE_SLICE64)) {
+		pr_err("%u slices per block need 64-bit slice pointers\n",
+		       sbi->slices_per_block);
+		brelse(bh);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+
+	/* Images without a slice map keep metadata in slice 0, refuse them */
+	if (sbi->nr_smap_blocks <
+	    DIV_ROUND_UP(sbi->nr_blocks, OUICHEFS_SMAP_PER_BLOCK(sb))) {
+		pr_err("No slice map on this partition, reformat it\n");
+		brelse(bh);
+		ret = -EINVAL;
+		goto free_sbi;
+	}
+
+	ret = ouichefs_parse_options(sb, data);
+	if (ret) {
+		brelse(bh);
+		goto free_sbi;
+	}
+
 	sbi->sliced_blocks = 0;
 	sbi->total_free_slices = 0;
 	sbi->files = 0;
 	sbi->small_files = 0;
 	sbi->total_data_size = 0;
 	sbi->total_used_size = 0;
-	sbi->s_free_sliced_blocks = 0;
-
 
 	brelse(bh);
 
-	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->ifree_bitmap) {
-		ret = -ENOMEM;
+	/* Free bitmaps are read block by block on first use */
+	ret = ouichefs_bitmap_init(sb, &sbi->ifree, sbi->nr_istore_blocks + 1,
+				   sbi->nr_ifree_blocks, sbi->nr_inodes, 0);
+	if (ret)
 		goto free_sbi;
-	}
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_ifree;
-		}
-
-		copy_bitmap_from_le64((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-			(__le64 *)bh->b_data);
+	ret = ouichefs_bitmap_init(sb, &sbi->bfree,
+				   sbi->nr_istore_blocks + sbi->nr_ifree_blocks + 1,
+				   sbi->nr_bfree_blocks, sbi->nr_blocks,
+				   sbi->nr_ifree_blocks);
+	if (ret)
+		goto free_ifree;
 
-		brelse(bh);
+	/* Bitmap blocks are written by sync_fs only once changed */
+	sbi->bitmap_dirty = bitmap_zalloc(sbi->nr_ifree_blocks +
+					  sbi->nr_bfree_blocks, GFP_KERNEL);
+	if (!sbi->bitmap_dirty) {
+		ret = -ENOMEM;
+		goto free_bitmaps;
 	}
 
-	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
-	if (!sbi->bfree_bitmap) {
+	sbi->wq = alloc_workqueue("ouichefs", WQ_UNBOUND, 0);
+	if (!sbi->wq) {
 		ret = -ENOMEM;
-		goto free_ifree;
+		goto free_dirty;
 	}
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_bfree;
-		}
 
-		copy_bitmap_from_le64((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-			(__le64 *)bh->b_data);
-
-		brelse(bh);
+	if (sbi->s_features & OUICHEFS_FEATURE_JOURNAL) {
+		ret = ouichefs_journal_init(sb, jseq, jnext);
+		if (ret)
+			goto free_wq;
 	}
 
 	/* 
@@ -346,23 +2351,33 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto free_journal;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	/* d_make_root should only be run once */
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto free_bfree;
+		goto free_journal;
 	}
 
+	/* Orphans are counted, clean partitions skip the scan */
+	if (!sb_rdonly(sb) && sbi->s_nr_orphans)
+		ouichefs_free_orphans(sb);
+
 	ouichefs_sysfs_init(sb);
 	return 0;
 
-free_bfree:
-	kfree(sbi->bfree_bitmap);
+free_journal:
+	ouichefs_journal_destroy(sb);
+free_wq:
+	destroy_workqueue(sbi->wq);
+free_dirty:
+	bitmap_free(sbi->bitmap_dirty);
+free_bitmaps:
+	ouichefs_bitmap_destroy(&sbi->bfree);
 free_ifree:
-	kfree(sbi->ifree_bitmap);
+	ouichefs_bitmap_destroy(&sbi->ifree);
 free_sbi:
 	kfree(sbi);
 
@@ -402,7 +2417,6 @@ static struct kobj_type ouichefs_kobj_type = {
 };
 
 // 1. define all attrs
-DEFINE_OUICHEFS_ATTR_U32(free_blocks, nr_free_blocks);
 DEFINE_OUICHEFS_ATTR_U32(sliced_blocks, sliced_blocks);
 DEFINE_OUICHEFS_ATTR_U32(total_free_slices, total_free_slices);
 DEFINE_OUICHEFS_ATTR_U32(files, files);
@@ -421,12 +2435,21 @@ static ssize_t efficiency_show(struct kobject *kobj,
 }
 static struct kobj_attribute efficiency_attr = __ATTR_RO(efficiency);
 
+// free_blocks counts the blocks held in per-CPU caches as free
+static ssize_t free_blocks_show(struct kobject *kobj,
+				struct kobj_attribute *attr, char *buf)
+{
+	struct ouichefs_sb_info *sbi = container_of(kobj, struct ouichefs_sb_info, sysfs_kobj);
+	return sprintf(buf, "%u\n", count_free_blocks(sbi));
+}
+static struct kobj_attribute free_blocks_attr = __ATTR_RO(free_blocks);
+
 // used_blocks = nr_blocks - nr_free_blocks
 static ssize_t used_blocks_show(struct kobject *kobj,
 				struct kobj_attribute *attr, char *buf)
 {
 	struct ouichefs_sb_info *sbi = container_of(kobj, struct ouichefs_sb_info, sysfs_kobj);
-	return sprintf(buf, "%u\n", sbi->nr_blocks - sbi->nr_free_blocks);
+	return sprintf(buf, "%u\n", sbi->nr_blocks - count_free_blocks(sbi));
 }
 static struct kobj_attribute used_blocks_attr = __ATTR_RO(used_blocks);
 
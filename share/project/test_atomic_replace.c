@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/types.h>
+
+#define OUICHEFS_IOCTL_MAGIC 'O'
+#define OUICHEFS_IOCTL_GET_ATOMIC _IOR(OUICHEFS_IOCTL_MAGIC, 0x04, __u32)
+#define OUICHEFS_IOCTL_SET_ATOMIC _IOW(OUICHEFS_IOCTL_MAGIC, 0x05, __u32)
+
+/*
+ * A small write to an atomic file replaces its content at once: readers see
+ * the content from before the write or the one after, never a mix. Writes
+ * follow POSIX offsets, the data lands at the offset given and the rest of
+ * the content stays.
+ */
+#define PATH "/mnt/ouichefs/test_atomic.txt"
+#define LONG_SIZE 300
+#define SHORT_SIZE 100
+#define OFFSET 42
+#define ROUNDS 2000
+
+/* SHORT_SIZE bytes of 'L' or of 'S', then 'L' up to LONG_SIZE bytes */
+static int valid(const char *buf, ssize_t n)
+{
+    if (n != LONG_SIZE || (buf[0] != 'L' && buf[0] != 'S'))
+        return 0;
+    for (ssize_t i = 0; i < n; i++)
+        if (buf[i] != (i < SHORT_SIZE ? buf[0] : 'L'))
+            return 0;
+    return 1;
+}
+
+static int replace(int fd, char c, size_t size, off_t offset)
+{
+    char buf[LONG_SIZE];
+
+    memset(buf, c, size);
+    return pwrite(fd, buf, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+/* Empty the file, it keeps its atomic flag */
+static int empty(void)
+{
+    int fd = open(PATH, O_WRONLY | O_TRUNC);
+
+    if (fd < 0)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+int main()
+{
+    char buf[LONG_SIZE + 1];
+    struct stat st;
+    __u32 on = 1;
+    int fd, status, ret = 0;
+    pid_t reader;
+
+    // Step 1: Create the file and turn atomic writes on
+    fd = open(PATH, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    if (ioctl(fd, OUICHEFS_IOCTL_SET_ATOMIC, &on) < 0) {
+        perror("ioctl SET_ATOMIC");
+        return 1;
+    }
+    on = 0;
+    if (ioctl(fd, OUICHEFS_IOCTL_GET_ATOMIC, &on) < 0 || on != 1) {
+        fprintf(stderr, "❌ GET_ATOMIC returned %u\n", on);
+        return 1;
+    }
+    printf("✅ Atomic writes enabled.\n");
+
+    // Step 2: A shorter write at 0 overwrites the start, the size stays
+    if (replace(fd, 'L', LONG_SIZE, 0) < 0 ||
+        replace(fd, 'S', SHORT_SIZE, 0) < 0) {
+        perror("write");
+        return 1;
+    }
+    fstat(fd, &st);
+    if (st.st_size != LONG_SIZE ||
+        pread(fd, buf, sizeof(buf), 0) != LONG_SIZE ||
+        !valid(buf, LONG_SIZE) || buf[0] != 'S') {
+        fprintf(stderr, "❌ Size %ld after overwrite, expected %d\n",
+                (long)st.st_size, LONG_SIZE);
+        ret = 1;
+    }
+
+    // Step 3: A write at an offset keeps what is before it
+    if (empty() < 0 || replace(fd, 'L', SHORT_SIZE, 0) < 0 ||
+        replace(fd, 'S', SHORT_SIZE, OFFSET) < 0) {
+        perror("pwrite");
+        return 1;
+    }
+    fstat(fd, &st);
+    memset(buf, 0, sizeof(buf));
+    if (st.st_size != OFFSET + SHORT_SIZE ||
+        pread(fd, buf, sizeof(buf), 0) != OFFSET + SHORT_SIZE) {
+        fprintf(stderr, "❌ Size %ld after offset write, expected %d\n",
+                (long)st.st_size, OFFSET + SHORT_SIZE);
+        ret = 1;
+    }
+    for (int i = 0; i < OFFSET + SHORT_SIZE; i++) {
+        if (buf[i] != (i < OFFSET ? 'L' : 'S')) {
+            fprintf(stderr, "❌ Byte %d is '%c' after offset write\n", i,
+                    buf[i]);
+            ret = 1;
+            break;
+        }
+    }
+    if (!ret)
+        printf("✅ Size and content follow the write offsets.\n");
+
+    // The file is LONG_SIZE bytes of 'L' for the reader below
+    if (empty() < 0 || replace(fd, 'L', LONG_SIZE, 0) < 0) {
+        perror("write");
+        return 1;
+    }
+
+    // Step 4: A concurrent reader never sees a mix of both contents
+    reader = fork();
+    if (reader == 0) {
+        int rfd = open(PATH, O_RDONLY);
+
+        for (;;) {
+            ssize_t n = pread(rfd, buf, sizeof(buf), 0);
+
+            if (n > 0 && !valid(buf, n))
+                _exit(1);
+        }
+    }
+    for (int i = 0; i < ROUNDS; i++) {
+        if (replace(fd, i % 2 ? 'S' : 'L', SHORT_SIZE, 0) < 0) {
+            perror("write");
+            ret = 1;
+            break;
+        }
+    }
+    // The reader only exits by itself on a torn read
+    kill(reader, SIGKILL);
+    waitpid(reader, &status, 0);
+    if (WIFEXITED(status)) {
+        fprintf(stderr, "❌ Reader saw a torn content\n");
+        ret = 1;
+    } else {
+        printf("✅ %d replacements, no torn read.\n", ROUNDS);
+    }
+
+    close(fd);
+    unlink(PATH);
+    return ret;
+}
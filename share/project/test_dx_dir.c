@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+ * A directory past one block worth of entries is converted to a hashed index,
+ * whose leaves split as it grows. readdir must list each name exactly once,
+ * even with names added and removed while it runs.
+ */
+#define DIR_PATH "/mnt/ouichefs/test_dx"
+#define NR_FILES 1000
+
+static char seen[2 * NR_FILES];
+
+static int create(int i)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), DIR_PATH "/file_%d", i);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Count one more sighting of a file_N name, return N or -1 */
+static int see(const char *name)
+{
+    int i;
+
+    if (sscanf(name, "file_%d", &i) != 1 || i < 0 || i >= 2 * NR_FILES)
+        return -1;
+    seen[i]++;
+    return i;
+}
+
+int main()
+{
+    struct dirent *de;
+    char path[256];
+    struct stat st;
+    DIR *dir;
+    int ret = 0, n = 0;
+
+    // Step 1: Fill a new directory, converting it and splitting leaves
+    if (mkdir(DIR_PATH, 0755) < 0) {
+        perror("mkdir");
+        return 1;
+    }
+    for (int i = 0; i < NR_FILES; i++)
+        if (create(i) < 0)
+            return 1;
+    printf("✅ Created %d files.\n", NR_FILES);
+
+    // Step 2: Every name is listed once and found by lookup
+    dir = opendir(DIR_PATH);
+    if (!dir) {
+        perror("opendir");
+        return 1;
+    }
+    while ((de = readdir(dir)))
+        see(de->d_name);
+    closedir(dir);
+    for (int i = 0; i < NR_FILES; i++) {
+        snprintf(path, sizeof(path), DIR_PATH "/file_%d", i);
+        if (seen[i] != 1 || stat(path, &st) < 0) {
+            fprintf(stderr, "❌ file_%d listed %d times\n", i, seen[i]);
+            ret = 1;
+        }
+    }
+    if (!ret)
+        printf("✅ readdir listed each file once.\n");
+
+    // Step 3: Unlink odd files and add new ones halfway through a listing
+    memset(seen, 0, sizeof(seen));
+    dir = opendir(DIR_PATH);
+    if (!dir) {
+        perror("opendir");
+        return 1;
+    }
+    while ((de = readdir(dir))) {
+        see(de->d_name);
+        if (++n != NR_FILES / 2)
+            continue;
+        for (int i = 1; i < NR_FILES; i += 2) {
+            snprintf(path, sizeof(path), DIR_PATH "/file_%d", i);
+            unlink(path);
+        }
+        for (int i = NR_FILES; i < 2 * NR_FILES; i++)
+            if (create(i) < 0)
+                return 1;
+    }
+    closedir(dir);
+
+    // Names present all along are listed once, others at most once
+    for (int i = 0; i < 2 * NR_FILES; i++) {
+        if (seen[i] > 1 || (i < NR_FILES && !(i % 2) && seen[i] != 1)) {
+            fprintf(stderr, "❌ file_%d listed %d times during changes\n",
+                    i, seen[i]);
+            ret = 1;
+        }
+    }
+    if (!ret)
+        printf("✅ Listing stayed consistent across splits and removals.\n");
+
+    // Step 4: Clean up, the directory must end up empty
+    for (int i = 0; i < 2 * NR_FILES; i++) {
+        snprintf(path, sizeof(path), DIR_PATH "/file_%d", i);
+        unlink(path);
+    }
+    if (rmdir(DIR_PATH) < 0) {
+        perror("rmdir");
+        ret = 1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*
+ * Journal replay test, in two runs on a partition mounted with a journal:
+ *   ./test_journal_replay prepare   then crash the machine while it waits
+ *                                   (echo b > /proc/sysrq-trigger)
+ *   ./test_journal_replay check     after the reboot and mount
+ * Everything fsync'd before the crash must be back, and the O_TMPFILE file
+ * still open at the crash must be freed at mount.
+ */
+#define DIR "/mnt/ouichefs/test_journal"
+#define NR_FILES 40
+
+static void fill(char *buf, size_t size, int i)
+{
+    for (size_t j = 0; j < size; j++)
+        buf[j] = 'a' + (i + j) % 26;
+}
+
+/* Small files go to slices, every fourth one spans several blocks */
+static size_t file_size(int i)
+{
+    return i % 4 ? 50 + i * 7 : 3 * 4096 + i;
+}
+
+static int prepare(void)
+{
+    char path[256], buf[4 * 4096];
+    struct statvfs st;
+    int fd, dfd;
+
+    // Step 1: Create files and fsync each of them
+    if (mkdir(DIR, 0755) < 0) {
+        perror("mkdir");
+        return 1;
+    }
+    for (int i = 0; i < NR_FILES; i++) {
+        snprintf(path, sizeof(path), DIR "/f%d", i);
+        fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open");
+            return 1;
+        }
+        fill(buf, file_size(i), i);
+        if (write(fd, buf, file_size(i)) != (ssize_t)file_size(i) ||
+            fsync(fd) < 0) {
+            perror("write");
+            return 1;
+        }
+        close(fd);
+    }
+
+    // Step 2: Rename and unlink, then fsync the directory
+    if (rename(DIR "/f1", DIR "/renamed") < 0 || unlink(DIR "/f2") < 0) {
+        perror("rename/unlink");
+        return 1;
+    }
+    dfd = open(DIR, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0 || fsync(dfd) < 0) {
+        perror("fsync dir");
+        return 1;
+    }
+
+    // Step 3: Record the free inodes, the orphan below must not use one
+    fd = open(DIR "/ffree", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0 || statvfs(DIR, &st) < 0) {
+        perror("statvfs");
+        return 1;
+    }
+    dprintf(fd, "%lu\n", (unsigned long)st.f_ffree);
+    fsync(fd);
+    close(fd);
+
+    // Step 4: Keep an O_TMPFILE file open, its inode is committed
+    fd = open(DIR, O_TMPFILE | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("O_TMPFILE");
+        return 1;
+    }
+    fill(buf, 100, 0);
+    if (write(fd, buf, 100) != 100 || fsync(fd) < 0 || fsync(dfd) < 0) {
+        perror("write tmpfile");
+        return 1;
+    }
+
+    printf("✅ Prepared, crash the machine now (echo b > /proc/sysrq-trigger)\n");
+    pause();
+    return 0;
+}
+
+static int check(void)
+{
+    char path[256], buf[4 * 4096], expected[4 * 4096];
+    unsigned long ffree;
+    struct statvfs st;
+    struct stat sb;
+    FILE *f;
+    int fd, ret = 0;
+
+    // Step 1: Every file is back with its content
+    for (int i = 0; i < NR_FILES; i++) {
+        if (i == 2)
+            continue;
+        if (i == 1)
+            snprintf(path, sizeof(path), DIR "/renamed");
+        else
+            snprintf(path, sizeof(path), DIR "/f%d", i);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "❌ %s is missing\n", path);
+            ret = 1;
+            continue;
+        }
+        fill(expected, file_size(i), i);
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n != (ssize_t)file_size(i) ||
+            memcmp(buf, expected, file_size(i))) {
+            fprintf(stderr, "❌ %s: bad content (%zd bytes)\n", path, n);
+            ret = 1;
+        }
+        close(fd);
+    }
+
+    // Step 2: Renamed and unlinked names are gone
+    if (stat(DIR "/f1", &sb) == 0 || stat(DIR "/f2", &sb) == 0) {
+        fprintf(stderr, "❌ Removed names are back\n");
+        ret = 1;
+    }
+
+    // Step 3: The orphan inode was freed at mount
+    f = fopen(DIR "/ffree", "r");
+    if (!f || fscanf(f, "%lu", &ffree) != 1 || statvfs(DIR, &st) < 0) {
+        perror("ffree");
+        return 1;
+    }
+    fclose(f);
+    if (st.f_ffree != ffree) {
+        fprintf(stderr, "❌ Free inodes: %lu, expected %lu\n",
+                (unsigned long)st.f_ffree, ffree);
+        ret = 1;
+    }
+
+    // Step 4: New files can be created, nothing is allocated twice
+    fd = open(DIR "/after", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, "after\n", 6) != 6) {
+        perror("create after replay");
+        ret = 1;
+    }
+    close(fd);
+    fd = open(DIR "/f0", O_RDONLY);
+    fill(expected, file_size(0), 0);
+    if (fd < 0 || read(fd, buf, sizeof(buf)) != (ssize_t)file_size(0) ||
+        memcmp(buf, expected, file_size(0))) {
+        fprintf(stderr, "❌ f0 changed by a new allocation\n");
+        ret = 1;
+    }
+    close(fd);
+
+    if (!ret)
+        printf("✅ Journal replay brought everything back.\n");
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "prepare"))
+        return prepare();
+    if (argc == 2 && !strcmp(argv[1], "check"))
+        return check();
+
+    fprintf(stderr, "Usage: %s prepare|check\n", argv[0]);
+    return 1;
+}
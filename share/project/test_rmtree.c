@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/types.h>
+
+#define OUICHEFS_IOCTL_MAGIC 'O'
+#define OUICHEFS_IOCTL_RMTREE _IO(OUICHEFS_IOCTL_MAGIC, 0x03)
+
+/*
+ * OUICHEFS_IOCTL_RMTREE empties a directory: files and subdirectories go in
+ * batches, the directory itself stays. Every inode, block and slice of the
+ * tree is given back, and the directory can be filled again.
+ */
+#define DIR_PATH "/mnt/ouichefs/test_rmtree"
+#define DEPTH 3
+#define NR_FILES 40
+#define NR_DX_FILES 600
+
+/* Small files go to slices, every tenth one to blocks */
+static int create(const char *dir, int i)
+{
+    char path[256], buf[3 * 4096];
+    size_t size = i % 10 ? (size_t)(20 + i * 3) : sizeof(buf);
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/file_%d", dir, i);
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    memset(buf, 'a' + i % 26, size);
+    if (write(fd, buf, size) != (ssize_t)size) {
+        perror("write");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* NR_FILES files and a subdirectory per level, DEPTH levels below dir */
+static int fill(const char *dir, int depth)
+{
+    char path[256];
+
+    for (int i = 0; i < NR_FILES; i++)
+        if (create(dir, i) < 0)
+            return -1;
+    if (!depth)
+        return 0;
+    snprintf(path, sizeof(path), "%s/sub_%d", dir, depth);
+    if (mkdir(path, 0755) < 0) {
+        perror("mkdir");
+        return -1;
+    }
+    return fill(path, depth - 1);
+}
+
+static int count_entries(const char *dir)
+{
+    struct dirent *de;
+    DIR *d = opendir(dir);
+    int n = 0;
+
+    if (!d)
+        return -1;
+    while ((de = readdir(d)))
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+            n++;
+    closedir(d);
+    return n;
+}
+
+/* Freed blocks and slices come back once the removal is committed */
+static int usage(struct statvfs *st)
+{
+    sync();
+    sync();
+    return statvfs(DIR_PATH, st);
+}
+
+int main()
+{
+    struct statvfs before, after;
+    char path[256];
+    int fd, ret = 0;
+
+    // Step 1: Build a tree, one of its directories hashed
+    if (mkdir(DIR_PATH, 0755) < 0) {
+        perror("mkdir");
+        return 1;
+    }
+    if (usage(&before) < 0) {
+        perror("statvfs");
+        return 1;
+    }
+    if (fill(DIR_PATH, DEPTH) < 0)
+        return 1;
+    snprintf(path, sizeof(path), DIR_PATH "/dx");
+    if (mkdir(path, 0755) < 0) {
+        perror("mkdir");
+        return 1;
+    }
+    for (int i = 0; i < NR_DX_FILES; i++)
+        if (create(path, i) < 0)
+            return 1;
+    printf("✅ Tree of %d levels built.\n", DEPTH);
+
+    // Step 2: Remove everything below the directory
+    fd = open(DIR_PATH, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    if (ioctl(fd, OUICHEFS_IOCTL_RMTREE) < 0) {
+        perror("ioctl RMTREE");
+        return 1;
+    }
+    close(fd);
+    if (count_entries(DIR_PATH) != 0) {
+        fprintf(stderr, "❌ Entries left after RMTREE\n");
+        ret = 1;
+    } else {
+        printf("✅ Directory emptied.\n");
+    }
+
+    // Step 3: Every inode and block of the tree is free again
+    if (usage(&after) < 0) {
+        perror("statvfs");
+        return 1;
+    }
+    if (after.f_ffree != before.f_ffree || after.f_bfree != before.f_bfree) {
+        fprintf(stderr, "❌ Free inodes %lu/%lu, free blocks %lu/%lu\n",
+                (unsigned long)after.f_ffree, (unsigned long)before.f_ffree,
+                (unsigned long)after.f_bfree, (unsigned long)before.f_bfree);
+        ret = 1;
+    } else {
+        printf("✅ Inodes and blocks given back.\n");
+    }
+
+    // Step 4: The directory is still usable
+    if (create(DIR_PATH, 0) < 0 || count_entries(DIR_PATH) != 1) {
+        fprintf(stderr, "❌ Directory unusable after RMTREE\n");
+        ret = 1;
+    }
+    snprintf(path, sizeof(path), DIR_PATH "/file_0");
+    unlink(path);
+    if (rmdir(DIR_PATH) < 0) {
+        perror("rmdir");
+        ret = 1;
+    }
+
+    return ret;
+}